@@ -0,0 +1,77 @@
+#!/usr/bin/env python3
+#
+# A fake CentralEGA, answering after a configurable latency,
+# to measure how fast the users can be resolved (see ega_cache_warm -n).
+#
+# It knows the users user0 to user<N-1>, with uid 1 to N, at:
+#   /users/<username>    /uid/<uid>
+#   /batch/<u1,u2,...>   /batchuid/<uid1,uid2,...>
+#
+# Usage: cega_stub.py [--port 8899] [--latency 0.1] [--users 100000]
+#
+# and in auth.conf:
+#   cega_endpoint_username = http://127.0.0.1:8899/users/%s
+#   cega_endpoint_uid = http://127.0.0.1:8899/uid/%u
+#   cega_endpoint_username_batch = http://127.0.0.1:8899/batch/%s
+#   cega_endpoint_uid_batch = http://127.0.0.1:8899/batchuid/%s
+#   cega_json_prefix =
+#
+
+import argparse
+import json
+import time
+from http.server import ThreadingHTTPServer, BaseHTTPRequestHandler
+
+parser = argparse.ArgumentParser(description='Fake CentralEGA')
+parser.add_argument('--port', type=int, default=8899)
+parser.add_argument('--latency', type=float, default=0.1, help='seconds, before each answer')
+parser.add_argument('--users', type=int, default=100000)
+args = parser.parse_args()
+
+def user(username):
+    if not username.startswith('user') or not username[4:].isdigit(): return None
+    i = int(username[4:])
+    if i >= args.users: return None
+    return { 'username': username,
+             'uid': i + 1,
+             'passwordHash': '$2b$12$' + 'x' * 53,
+             'sshPublicKey': 'ssh-ed25519 AAAAC3NzaC1lZDI1NTE5AAAA' + username,
+             'gecos': 'EGA User ' + username }
+
+def by_uid(uid):
+    return user('user%d' % (int(uid) - 1)) if uid.isdigit() and int(uid) > 0 else None
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1' # keep-alive
+    disable_nagle_algorithm = True
+
+    def log_message(self, *args):
+        pass
+
+    def do_GET(self):
+        if args.latency: time.sleep(args.latency)
+        parts = self.path.split('/')
+        body = None
+        if len(parts) == 3:
+            kind, what = parts[1], parts[2]
+            if kind == 'users': body = user(what)
+            elif kind == 'uid': body = by_uid(what)
+            elif kind == 'batch': body = [u for u in map(user, what.split(',')) if u]
+            elif kind == 'batchuid': body = [u for u in map(by_uid, what.split(',')) if u]
+        if body is None:
+            self.send_response(404)
+            self.send_header('Content-Length', '0')
+            self.end_headers()
+            return
+        data = json.dumps(body).encode()
+        self.send_response(200)
+        self.send_header('Content-Type', 'application/json')
+        self.send_header('Content-Length', str(len(data)))
+        self.end_headers()
+        self.wfile.write(data)
+
+class Server(ThreadingHTTPServer):
+    daemon_threads = True
+    request_queue_size = 1024
+
+Server(('127.0.0.1', args.port), Handler).serve_forever()
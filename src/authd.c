@@ -0,0 +1,445 @@
+#define _GNU_SOURCE /* for struct ucred */
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <pwd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "utils.h"
+#include "backend.h"
+#include "cega.h"
+#include "homedir.h"
+#include "refresh.h"
+#include "authd.h"
+
+/*
+ * ega-authd: owns the cache, the connection to CentralEGA and the configuration,
+ * and answers the NSS module, the PAM module and ega_ssh_keys over a Unix socket.
+ *
+ * Each connection is served by its own thread, so that a lookup waiting
+ * for CentralEGA does not hold up the others (cache hits in particular).
+ * Only root peers can trigger a CentralEGA lookup or read a password hash,
+ * as in the in-process path. Others only get what is already in the cache,
+ * except for the ssh public keys: they are not secret, and ega_ssh_keys runs
+ * as sshd's AuthorizedKeysCommandUser, which is seldom root.
+ *
+ * At most AUTHD_MAX_CLIENTS connections are served at once, and at most
+ * AUTHD_MAX_UNPRIVILEGED of them for non-root peers, so that those cannot
+ * hold up root's lookups. The connections over the limits are closed
+ * right away, and the clients fall back to the in-process lookups.
+ *
+ * The stale entries are refreshed, the cache purged and the lookup index
+ * rebuilt by another thread, every second (see _maintain).
+ */
+
+#define AUTHD_REQUEST_TIMEOUT 1 /* seconds, for a client to send its request */
+#define AUTHD_MAX_CLIENTS 256
+#define AUTHD_MAX_UNPRIVILEGED 64
+
+static volatile sig_atomic_t running = 1;
+static void stop(int sig){ running = 0; }
+
+/* The answer being prepared, per thread. Its fields point into buffer */
+static __thread struct authd_response_s res;
+static __thread const char* fields[AUTHD_FIELDS];
+static __thread char buffer[AUTHD_MAX_PAYLOAD];
+
+static unsigned int clients = 0;      /* being served */
+static unsigned int unprivileged = 0; /* among them */
+
+struct authd_client_s {
+  int fd;
+  struct ucred peer;
+};
+
+static int
+_set_passwd(const struct passwd *pw)
+{
+  res.uid = pw->pw_uid;
+  res.gid = pw->pw_gid;
+  fields[AUTHD_FIELD_NAME]  = pw->pw_name;
+  fields[AUTHD_FIELD_GECOS] = pw->pw_gecos;
+  fields[AUTHD_FIELD_DIR]   = pw->pw_dir;
+  fields[AUTHD_FIELD_SHELL] = pw->pw_shell;
+  return AUTHD_FOUND;
+}
+
+static int
+_set_string(char* s)
+{
+  char* bufptr = buffer;
+  size_t buflen = sizeof(buffer);
+  if( copy2buffer(s, (char**)&fields[0], &bufptr, &buflen) < 0 ){ D1("Buffer too small"); return AUTHD_ERROR; }
+  return AUTHD_FOUND;
+}
+
+static int
+_getpwnam(const char* username, bool privileged)
+{
+  struct passwd pw;
+  bool use_backend = backend_opened();
+  int rc = 1;
+
+  if(use_backend){
+    rc = backend_getpwnam_r(username, &pw, buffer, sizeof(buffer));
+    if( rc == -1 ){ D1("Buffer too small"); return AUTHD_ERROR; }
+    if( rc == 0  ){ D1("User %s found in cache", username); return _set_passwd(&pw); }
+  }
+
+  if( !privileged ){ return AUTHD_NOT_FOUND; }
+  if( use_backend && backend_is_unknown_user(username) ){ D1("User %s unknown to CentralEGA [cached]", username); return AUTHD_NOT_FOUND; }
+
+  /* Defining the callback */
+  int cega_callback(char* uname, uid_t uid, char* password_hash, char* pubkey, char* gecos){
+
+    /* assert same name */
+    if( strcmp(username, uname) ){
+      REPORT("Requested username %s not matching username response %s", username, uname);
+      return 1;
+    }
+
+    if(use_backend) backend_add_user(username, uid, password_hash, pubkey, gecos);
+
+    /* Prepare the answer */
+    char* bufptr = buffer;
+    size_t buflen = sizeof(buffer);
+    char* homedir = strjoina(options->ega_dir, "/", username);
+    pw.pw_name = (char*)username;
+    pw.pw_passwd = "x";
+    pw.pw_uid = uid;
+    pw.pw_gid = options->gid;
+    if( copy2buffer(homedir, &(pw.pw_dir)   , &bufptr, &buflen) < 0 ) { return -1; }
+    if( copy2buffer(gecos,   &(pw.pw_gecos) , &bufptr, &buflen) < 0 ) { return -1; }
+    if( copy2buffer(options->shell, &(pw.pw_shell), &bufptr, &buflen) < 0 ) { return -1; }
+
+    /* make sure the homedir is created */
+    create_ega_dir(&pw);
+    return 0;
+  }
+
+  _cleanup_str_ char* endpoint = (char*)malloc((options->cega_endpoint_username_len + strlen(username)) * sizeof(char));
+  if(!endpoint){ D1("Memory allocation error"); return AUTHD_ERROR; }
+  if( sprintf(endpoint, options->cega_endpoint_username, username) < 0 ){
+    D1("Error formatting the endpoint"); return AUTHD_ERROR;
+  }
+  /* In case another process fetched it in the meantime */
+  int cached(void){
+    int rc = backend_getpwnam_r(username, &pw, buffer, sizeof(buffer));
+    return (rc == 1 && backend_is_unknown_user(username))?CEGA_NOT_FOUND:rc;
+  }
+
+  rc = cega_resolve_coalesced(endpoint, (use_backend)?cached:NULL, cega_callback);
+  if( rc == -1 ){ D1("Buffer too small"); return AUTHD_ERROR; }
+  if( rc == CEGA_NOT_FOUND ){ if(use_backend) backend_add_unknown_user(username); }
+  if( rc != 0 ) { D1("User %s not found in CentralEGA", username); return AUTHD_NOT_FOUND; }
+  return _set_passwd(&pw);
+}
+
+static int
+_getpwuid(uid_t uid, bool privileged)
+{
+  struct passwd pw;
+  bool use_backend = backend_opened();
+  int rc = 1;
+
+  uid_t ruid = uid - options->uid_shift;
+  if( ruid <= 0 ){ D2("... too low: ignoring"); return AUTHD_NOT_FOUND; }
+
+  if(use_backend){
+    rc = backend_getpwuid_r(uid, &pw, buffer, sizeof(buffer));
+    if( rc == -1 ){ D1("Buffer too small"); return AUTHD_ERROR; }
+    if( rc == 0  ){ D1("User id %u found in cache", uid); return _set_passwd(&pw); }
+  }
+
+  if( !privileged ){ return AUTHD_NOT_FOUND; }
+  if( use_backend && backend_is_unknown_uid(uid) ){ D1("User id %u unknown to CentralEGA [cached]", uid); return AUTHD_NOT_FOUND; }
+
+  /* Defining the callback */
+  int cega_callback(char* uname, uid_t ega_uid, char* password_hash, char* pubkey, char* gecos){
+
+    /* assert same uid */
+    if( ega_uid != uid ){
+      REPORT("Requested user id %u not matching user id response %u", uid, ega_uid);
+      return 1;
+    }
+
+    if(use_backend) backend_add_user(uname, uid, password_hash, pubkey, gecos);
+
+    /* Prepare the answer */
+    char* bufptr = buffer;
+    size_t buflen = sizeof(buffer);
+    char* homedir = strjoina(options->ega_dir, "/", uname);
+    if( copy2buffer(uname, &(pw.pw_name)    , &bufptr, &buflen) < 0 ) { return -1; }
+    pw.pw_passwd = "x";
+    pw.pw_uid = uid;
+    pw.pw_gid = options->gid;
+    if( copy2buffer(homedir, &(pw.pw_dir)   , &bufptr, &buflen) < 0 ) { return -1; }
+    if( copy2buffer(gecos,   &(pw.pw_gecos) , &bufptr, &buflen) < 0 ) { return -1; }
+    if( copy2buffer(options->shell, &(pw.pw_shell), &bufptr, &buflen) < 0 ) { return -1; }
+    return 0;
+  }
+
+  _cleanup_str_ char* endpoint = (char*)malloc((options->cega_endpoint_uid_len + 32) * sizeof(char));
+  /* Laaaaaaaarge enough! */
+  if(!endpoint){ D1("Memory allocation error"); return AUTHD_ERROR; }
+  if( sprintf(endpoint, options->cega_endpoint_uid, ruid) < 0 ){
+    D1("Error formatting the endpoint"); return AUTHD_ERROR;
+  }
+  /* In case another process fetched it in the meantime */
+  int cached(void){
+    int rc = backend_getpwuid_r(uid, &pw, buffer, sizeof(buffer));
+    return (rc == 1 && backend_is_unknown_uid(uid))?CEGA_NOT_FOUND:rc;
+  }
+
+  rc = cega_resolve_coalesced(endpoint, (use_backend)?cached:NULL, cega_callback);
+  if( rc == -1 ){ D1("Buffer too small"); return AUTHD_ERROR; }
+  if( rc == CEGA_NOT_FOUND ){ if(use_backend) backend_add_unknown_uid(uid); }
+  if( rc != 0 ) { D1("User id %u not found in CentralEGA", uid); return AUTHD_NOT_FOUND; }
+  return _set_passwd(&pw);
+}
+
+/*
+ * Password hash or public key, from the cache or CentralEGA.
+ * The caller checks that the peer may get it.
+ */
+static int
+_get_credential(const char* username, bool want_pubkey)
+{
+  bool use_backend = backend_opened();
+  _cleanup_str_ char* data = NULL;
+
+  if(use_backend){
+    if( want_pubkey && backend_get_pubkey(username, &data)) return _set_string(data);
+    if(!want_pubkey && backend_get_password_hash(username, &data)) return _set_string(data);
+  }
+
+  if( use_backend && backend_is_unknown_user(username) ){ D1("User %s unknown to CentralEGA [cached]", username); return AUTHD_NOT_FOUND; }
+
+  /* Defining the CentralEGA callback */
+  int cega_callback(char* uname, uid_t uid, char* password_hash, char* pubkey, char* gecos){
+    /* assert same name */
+    if( strcmp(username, uname) ){
+      REPORT("Requested username %s not matching username response %s", username, uname);
+      return 1;
+    }
+    if(use_backend) backend_add_user(username, uid, password_hash, pubkey, gecos); // ignore result
+    char* value = (want_pubkey)?pubkey:password_hash;
+    if(!value){ REPORT("No %s found for user '%s'", (want_pubkey)?"ssh key":"password hash", username); return 1; }
+    return (_set_string(value) == AUTHD_FOUND)?0:-1;
+  }
+
+  _cleanup_str_ char* endpoint = (char*)malloc((options->cega_endpoint_username_len + strlen(username)) * sizeof(char));
+  if(!endpoint){ D1("Memory allocation error"); return AUTHD_ERROR; }
+  if( sprintf(endpoint, options->cega_endpoint_username, username) < 0 ){
+    D1("Error formatting the endpoint"); return AUTHD_ERROR;
+  }
+  /* In case another process fetched it in the meantime */
+  int cached(void){
+    bool found = (want_pubkey)?backend_get_pubkey(username, &data):backend_get_password_hash(username, &data);
+    if(found) return (_set_string(data) == AUTHD_FOUND)?0:-1;
+    return (backend_is_unknown_user(username))?CEGA_NOT_FOUND:1;
+  }
+
+  int rc = cega_resolve_coalesced(endpoint, (use_backend)?cached:NULL, cega_callback);
+  if( rc == -1 ){ return AUTHD_ERROR; }
+  if( rc == CEGA_NOT_FOUND ){ if(use_backend) backend_add_unknown_user(username); }
+  return (rc == 0)?AUTHD_FOUND:AUTHD_NOT_FOUND;
+}
+
+static int
+_account(const char* username)
+{
+  if(!backend_opened()){ D1("Backend disabled: Account allowed by default"); return AUTHD_FOUND; }
+  if(!backend_has_expired(username)){ D1("Account valid for user '%s' [cached]", username); return AUTHD_FOUND; }
+  if(backend_is_unknown_user(username)){ D1("User '%s' unknown to CentralEGA [cached]", username); return AUTHD_NOT_FOUND; }
+
+  /* Defining the CentralEGA callback */
+  int cega_callback(char* uname, uid_t uid, char* password_hash, char* pubkey, char* gecos){
+    /* assert same name */
+    if( strcmp(username, uname) ){
+      REPORT("Requested username %s not matching username response %s", username, uname);
+      return 1;
+    }
+    backend_add_user(username, uid, password_hash, pubkey, gecos); // ignore result
+    return 0;
+  }
+
+  _cleanup_str_ char* endpoint = (char*)malloc((options->cega_endpoint_username_len + strlen(username)) * sizeof(char));
+  if(!endpoint){ D1("Memory allocation error"); return AUTHD_ERROR; }
+  if( sprintf(endpoint, options->cega_endpoint_username, username) < 0 ){
+    D1("Error formatting the endpoint"); return AUTHD_ERROR;
+  }
+  /* In case another process fetched it in the meantime */
+  int cached(void){
+    if(!backend_has_expired(username)) return 0;
+    return (backend_is_unknown_user(username))?CEGA_NOT_FOUND:1;
+  }
+
+  int rc = cega_resolve_coalesced(endpoint, cached, cega_callback);
+  if( rc == CEGA_NOT_FOUND ){ backend_add_unknown_user(username); return AUTHD_NOT_FOUND; }
+  return (rc == 0)?AUTHD_FOUND:AUTHD_ERROR;
+}
+
+/*
+ * Read one request, answer it, and hang up.
+ */
+static void
+_serve(int fd, const struct ucred* client)
+{
+  struct authd_request_s req;
+  char username[AUTHD_MAX_NAME];
+  struct ucred peer = *client;
+  struct timeval tv = { AUTHD_REQUEST_TIMEOUT, 0 };
+  int i;
+
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+  if( authd_read(fd, &req, sizeof(req)) ){ D1("Could not read the request"); return; }
+  if( req.namelen >= AUTHD_MAX_NAME ){ D1("Username too long: %u bytes", req.namelen); return; }
+  if( authd_read(fd, username, req.namelen) ){ D1("Could not read the username"); return; }
+  username[req.namelen] = '\0';
+
+  bool privileged = (peer.uid == 0);
+  D1("Request %u from pid %d [uid %u] for '%s' [%u]", req.op, peer.pid, peer.uid, username, req.uid);
+
+  memset(&res, 0, sizeof(res));
+  for(i = 0; i < AUTHD_FIELDS; i++) fields[i] = NULL;
+
+  switch(req.op){
+  case AUTHD_GETPWNAM:      res.status = _getpwnam(username, privileged);          break;
+  case AUTHD_GETPWUID:      res.status = _getpwuid((uid_t)req.uid, privileged);    break;
+  case AUTHD_PUBKEY:        res.status = _get_credential(username, true);          break; /* for anyone */
+  case AUTHD_PASSWORD_HASH: res.status = (privileged)?_get_credential(username, false):AUTHD_NOT_FOUND; break;
+  case AUTHD_ACCOUNT:       res.status = (privileged)?_account(username):AUTHD_UNAVAILABLE; break; /* checked in-process */
+  default:
+    D1("Unknown request: %u", req.op);
+    res.status = AUTHD_ERROR;
+  }
+
+  if(res.status != AUTHD_FOUND) for(i = 0; i < AUTHD_FIELDS; i++) fields[i] = NULL;
+  for(i = 0; i < AUTHD_FIELDS; i++) res.len[i] = (fields[i])?strlen(fields[i]):0;
+
+  if( authd_write(fd, &res, sizeof(res)) ){ D1("Could not send the response"); return; }
+  for(i = 0; i < AUTHD_FIELDS; i++){
+    if( authd_write(fd, fields[i], res.len[i]) ){ D1("Could not send field %d", i); return; }
+  }
+}
+
+static void*
+_client(void* arg)
+{
+  struct authd_client_s* c = (struct authd_client_s*)arg;
+  _serve(c->fd, &c->peer);
+  close(c->fd);
+  if(c->peer.uid != 0) __atomic_sub_fetch(&unprivileged, 1, __ATOMIC_RELAXED);
+  __atomic_sub_fetch(&clients, 1, __ATOMIC_RELAXED);
+  free(c);
+  return NULL;
+}
+
+/* Serves the connection <fd> in a new thread, or closes it when over the limits */
+static void
+_dispatch(int fd, pthread_attr_t* attr)
+{
+  pthread_t thread;
+  socklen_t peerlen = sizeof(struct ucred);
+  struct authd_client_s* c = malloc(sizeof(struct authd_client_s));
+
+  if(!c){ D1("Memory allocation error"); close(fd); return; }
+  c->fd = fd;
+  if( getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &c->peer, &peerlen) ){ D1("Unknown peer: %s", strerror(errno)); goto REFUSE; }
+
+  if( __atomic_add_fetch(&clients, 1, __ATOMIC_RELAXED) > AUTHD_MAX_CLIENTS ){
+    D1("Too many clients: refusing pid %d [uid %u]", c->peer.pid, c->peer.uid);
+    goto REFUSE_COUNTED;
+  }
+  if( c->peer.uid != 0 && __atomic_add_fetch(&unprivileged, 1, __ATOMIC_RELAXED) > AUTHD_MAX_UNPRIVILEGED ){
+    D1("Too many non-root clients: refusing pid %d [uid %u]", c->peer.pid, c->peer.uid);
+    __atomic_sub_fetch(&unprivileged, 1, __ATOMIC_RELAXED);
+    goto REFUSE_COUNTED;
+  }
+  if( pthread_create(&thread, attr, _client, (void*)c) == 0 ) return;
+
+  D1("Could not create a thread: %s", strerror(errno));
+  if(c->peer.uid != 0) __atomic_sub_fetch(&unprivileged, 1, __ATOMIC_RELAXED);
+
+REFUSE_COUNTED:
+  __atomic_sub_fetch(&clients, 1, __ATOMIC_RELAXED);
+REFUSE:
+  close(fd);
+  free(c);
+}
+
+/* Background work, every second: never in the way of the lookups */
+static void*
+_maintain(void* arg)
+{
+  while(running){
+    sleep(1);
+    refresh_run(); /* the stale entries served, and the purge */
+    backend_refresh_index(); /* rate-limited */
+  }
+  return NULL;
+}
+
+int
+main(int argc, const char **argv)
+{
+  struct sockaddr_un addr;
+  const char* path = (argc > 1)?argv[1]:EGA_AUTHD_SOCKET;
+
+  if( argc > 2 ){ fprintf(stderr, "Usage: %s [socket]\n", argv[0]); return 1; }
+  if( !backend_opened() ){ fprintf(stderr, "Could not open the backend: check %s\n", (options)?options->db_path:"the configuration"); return 2; }
+
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if(sock < 0){ fprintf(stderr, "Could not create socket: %s\n", strerror(errno)); return 3; }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(strlen(path) >= sizeof(addr.sun_path)){ fprintf(stderr, "Socket path too long: %s\n", path); return 3; }
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  unlink(path); /* stale socket from a previous run */
+  if( bind(sock, (struct sockaddr*)&addr, sizeof(addr)) ){ fprintf(stderr, "Could not bind %s: %s\n", path, strerror(errno)); return 3; }
+  chmod(path, 0666); /* Every process might resolve users */
+  if( listen(sock, SOMAXCONN) ){ fprintf(stderr, "Could not listen on %s: %s\n", path, strerror(errno)); return 3; }
+
+  REPORT("Listening on %s", path);
+  refresh_enable();
+
+  pthread_attr_t attr;
+  pthread_t maintainer;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if( pthread_create(&maintainer, &attr, _maintain, NULL) ){ fprintf(stderr, "Could not start the maintenance thread\n"); return 3; }
+
+  struct pollfd pfd = { sock, POLLIN, 0 };
+  while(running){
+    int n = poll(&pfd, 1, 1000); /* checks <running> every second */
+    if( n < 0 ){
+      if(errno == EINTR) continue;
+      D1("poll error: %s", strerror(errno));
+      break;
+    }
+    if( n == 0 ) continue;
+    int fd = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+    if(fd < 0){ D2("accept error: %s", strerror(errno)); continue; }
+    _dispatch(fd, &attr);
+  }
+  pthread_attr_destroy(&attr);
+
+  REPORT("Shutting down");
+  close(sock);
+  unlink(path);
+  return 0;
+}
@@ -0,0 +1,98 @@
+#ifndef __LEGA_AUTHD_H_INCLUDED__
+#define __LEGA_AUTHD_H_INCLUDED__
+
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+/*
+ * Protocol between ega-authd and its clients (NSS, PAM and ega_ssh_keys),
+ * over a Unix domain socket.
+ *
+ * One request and one response per connection.
+ * Both ends run on the same host, so integers are in host byte order.
+ *
+ * Request:  struct authd_request_s, followed by <namelen> bytes of username (no \0)
+ * Response: struct authd_response_s, followed by the fields, back to back (no \0),
+ *           field i being <len[i]> bytes long.
+ */
+
+#ifndef EGA_AUTHD_SOCKET
+#define EGA_AUTHD_SOCKET "/run/ega-authd.sock"
+#endif
+
+#define AUTHD_MAX_NAME 256             /* longest username we accept */
+#define AUTHD_MAX_PAYLOAD (1 << 16)    /* largest sum of the response fields */
+
+enum authd_op_e {
+  AUTHD_GETPWNAM = 1,  /* username -> passwd fields */
+  AUTHD_GETPWUID,      /* uid      -> passwd fields */
+  AUTHD_PASSWORD_HASH, /* username -> password hash, in field 0 */
+  AUTHD_PUBKEY,        /* username -> ssh public key, in field 0 */
+  AUTHD_ACCOUNT,       /* username -> is the account valid */
+};
+
+enum authd_status_e {
+  AUTHD_FOUND = 0,
+  AUTHD_NOT_FOUND,
+  AUTHD_ERROR,         /* eg CentralEGA could not be reached */
+  AUTHD_UNAVAILABLE,   /* the daemon could not be reached, or refused to answer */
+};
+
+/* Fields of the passwd answers */
+enum authd_field_e {
+  AUTHD_FIELD_NAME = 0,
+  AUTHD_FIELD_GECOS,
+  AUTHD_FIELD_DIR,
+  AUTHD_FIELD_SHELL,
+  AUTHD_FIELDS /* last */
+};
+
+struct authd_request_s {
+  uint32_t op;
+  uint32_t uid;
+  uint32_t namelen;
+};
+
+struct authd_response_s {
+  uint32_t status;
+  uint32_t uid;
+  uint32_t gid;
+  uint32_t len[AUTHD_FIELDS];
+};
+
+/*
+ * Read or write exactly <size> bytes.
+ * Returns 0 on success, and 1 otherwise (including a peer that hung up).
+ * Writing to a peer that hung up must not raise SIGPIPE in the host process.
+ */
+static inline int
+authd_read(int fd, void* data, size_t size)
+{
+  char* p = (char*)data;
+  while(size > 0){
+    ssize_t n = read(fd, p, size);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) return 1;
+    p += n;
+    size -= n;
+  }
+  return 0;
+}
+
+static inline int
+authd_write(int fd, const void* data, size_t size)
+{
+  const char* p = (const char*)data;
+  while(size > 0){
+    ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) return 1;
+    p += n;
+    size -= n;
+  }
+  return 0;
+}
+
+#endif /* !__LEGA_AUTHD_H_INCLUDED__ */
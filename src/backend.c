@@ -4,9 +4,14 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <syslog.h>
+#include <pthread.h>
 
 #include "utils.h"
 #include "backend.h"
+#include "refresh.h"
+#include "index.h"
+#include "pwent.h"
+#include "shmcache.h"
 
 /* DB schema */
 #define EGA_SCHEMA_FMT "CREATE TABLE IF NOT EXISTS users (                      \
@@ -20,26 +25,151 @@
 /* Not using "inserted REAL DEFAULT (strftime('%%s','now'))" */
 /* WITHOUT ROWID works only from 3.8.2 */
 
+/*
+ * Schema migrations
+ *
+ * The schema version is kept in "PRAGMA user_version".
+ * Migration i brings the database from version i to version i+1.
+ * Migration 0 is EGA_SCHEMA_FMT, formatted with the uid shift.
+ * Only append to that list.
+ */
+static const char* migrations[] = {
+  /* 0 -> 1 */ NULL, /* EGA_SCHEMA_FMT */
+  /* 1 -> 2 */ "DELETE FROM users WHERE uid IN (SELECT uid FROM users GROUP BY uid HAVING count(*) > 1);"
+               "CREATE UNIQUE INDEX IF NOT EXISTS users_uid ON users(uid);",
+  /* 2 -> 3 */ "CREATE TABLE IF NOT EXISTS unknown_users (username TEXT PRIMARY KEY ON CONFLICT REPLACE, expires REAL) WITHOUT ROWID;"
+               "CREATE TABLE IF NOT EXISTS unknown_uids (uid INTEGER PRIMARY KEY ON CONFLICT REPLACE, expires REAL);",
+  /* 3 -> 4 */ "ALTER TABLE users ADD COLUMN pwent BLOB;", /* see pwent.h */
+  /* 4 -> 5 */ "CREATE INDEX IF NOT EXISTS users_expires ON users(expires);"
+               "ALTER TABLE users ADD COLUMN accessed REAL;"
+               "UPDATE users SET accessed = strftime('%s', 'now');"
+               "CREATE INDEX IF NOT EXISTS users_accessed ON users(accessed);"
+               "CREATE TABLE IF NOT EXISTS meta (key TEXT PRIMARY KEY, value) WITHOUT ROWID;"
+               "INSERT OR IGNORE INTO meta (key, value) VALUES ('purged', 0);",
+};
+#define EGA_SCHEMA_VERSION ((int)ELEMENTSOF(migrations))
+
 
 static sqlite3* db = NULL;
 
 /*
- * Constructor/Destructor when the library is loaded
+ * Prepared statements
  *
- * See: http://man7.org/linux/man-pages/man3/dlopen.3.html
+ * Compiled once in backend_open(), reset and rebound on each call,
+ * and finalized in backend_close().
+ */
+enum backend_stmt_e {
+  STMT_ADD_USER = 0,
+  STMT_GETPWUID,
+  STMT_GETPWNAM,
+  STMT_PUBKEY,
+  STMT_PWDH,
+  STMT_EXPIRES,
+  STMT_EXPIRES_UID,
+  STMT_REMOVE_USER,
+  STMT_ALL_USERS,
+  STMT_ADD_UNKNOWN_USER,
+  STMT_ADD_UNKNOWN_UID,
+  STMT_IS_UNKNOWN_USER,
+  STMT_IS_UNKNOWN_UID,
+  STMT_DATA_VERSION,
+  STMT_TOUCH,
+  STMT_PURGED,
+  STMT_CLAIM_PURGE,
+  STMT_PURGE_USERS,
+  STMT_PURGE_UNKNOWN_USERS,
+  STMT_PURGE_UNKNOWN_UIDS,
+  STMT_EVICT_USERS,
+  STMT_SYNCED,
+  STMT_SET_SYNCED,
+  STMT_COUNT /* last */
+};
+
+static const char* stmts_sql[STMT_COUNT] = {
+  [STMT_ADD_USER]    = "INSERT OR REPLACE INTO users (username,uid,pwdh,pubkey,gecos,expires,pwent,accessed) VALUES(?1,?2,?3,?4,?5,?6,?7,strftime('%s', 'now'))",
+  [STMT_GETPWUID]    = "select username,uid,gecos,pwent,accessed from users where uid = ?1 LIMIT 1",
+  [STMT_GETPWNAM]    = "select username,uid,gecos,pwent,accessed from users where username = ?1 LIMIT 1",
+  [STMT_PUBKEY]      = "select pubkey, expires, accessed from users where username = ?1 AND expires > strftime('%s', 'now') - ?2 LIMIT 1",
+  [STMT_PWDH]        = "select pwdh, expires, accessed from users where username = ?1 AND expires > strftime('%s', 'now') - ?2 LIMIT 1",
+  [STMT_EXPIRES]     = "SELECT expires FROM users WHERE username = ?1",
+  [STMT_EXPIRES_UID] = "SELECT expires FROM users WHERE uid = ?1",
+  [STMT_REMOVE_USER] = "DELETE FROM users WHERE username = ?1",
+  [STMT_ALL_USERS]   = "SELECT username, uid, gecos FROM users",
+  [STMT_ADD_UNKNOWN_USER] = "INSERT INTO unknown_users (username,expires) VALUES(?1,?2)",
+  [STMT_ADD_UNKNOWN_UID]  = "INSERT INTO unknown_uids (uid,expires) VALUES(?1,?2)",
+  [STMT_IS_UNKNOWN_USER]  = "SELECT 1 FROM unknown_users WHERE username = ?1 AND expires > strftime('%s', 'now')",
+  [STMT_IS_UNKNOWN_UID]   = "SELECT 1 FROM unknown_uids WHERE uid = ?1 AND expires > strftime('%s', 'now')",
+  [STMT_DATA_VERSION]     = "PRAGMA data_version",
+  [STMT_TOUCH]            = "UPDATE users SET accessed = strftime('%s', 'now') WHERE username = ?1",
+  [STMT_PURGED]           = "SELECT value FROM meta WHERE key = 'purged'",
+  [STMT_CLAIM_PURGE]      = "UPDATE meta SET value = ?1 WHERE key = 'purged' AND value <= ?2",
+  [STMT_PURGE_USERS]      = "DELETE FROM users WHERE username IN (SELECT username FROM users WHERE expires < strftime('%s', 'now') - ?1 LIMIT ?2)",
+  [STMT_PURGE_UNKNOWN_USERS] = "DELETE FROM unknown_users WHERE expires < strftime('%s', 'now')",
+  [STMT_PURGE_UNKNOWN_UIDS]  = "DELETE FROM unknown_uids WHERE expires < strftime('%s', 'now')",
+  [STMT_EVICT_USERS]      = "DELETE FROM users WHERE username IN (SELECT username FROM users ORDER BY accessed LIMIT max(0, min(?2, (SELECT count(*) FROM users) - ?1)))",
+  [STMT_SYNCED]           = "SELECT value FROM meta WHERE key = 'synced'",
+  [STMT_SET_SYNCED]       = "INSERT OR REPLACE INTO meta (key, value) VALUES ('synced', ?1)",
+};
+
+static sqlite3_stmt* stmts[STMT_COUNT] = { NULL };
+
+/* One statement is used by one thread at a time, from bind to reset */
+static pthread_mutex_t stmt_locks[STMT_COUNT] = { [0 ... STMT_COUNT - 1] = PTHREAD_MUTEX_INITIALIZER };
+
+static void _lru_flush(void);
+
+/*
+ * Fetch a prepared statement, ready to be bound, and hold it.
+ * Release it with _put_stmt() when done, so the read lock is dropped,
+ * and other threads can use it.
+ */
+static inline sqlite3_stmt*
+_get_stmt(enum backend_stmt_e id)
+{
+  sqlite3_stmt *stmt = stmts[id];
+  if(!stmt){ D1("Statement %d not prepared", id); return NULL; }
+  pthread_mutex_lock(&stmt_locks[id]);
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  return stmt;
+}
+
+static inline void
+_put_stmt(sqlite3_stmt *stmt)
+{
+  int id;
+  sqlite3_reset(stmt);
+  for(id = 0; id < STMT_COUNT; id++){
+    if(stmts[id] == stmt){ pthread_mutex_unlock(&stmt_locks[id]); return; }
+  }
+}
+
+/*
+ * Initialization, on first use
  *
+ * The NSS module is loaded by every process looking up any user,
+ * (ls, id, cron...), most of which never ask for an EGA user.
+ * So we do not open the database when the library is loaded,
+ * but on the first lookup that needs it (see backend_opened).
  */
-__attribute__((constructor))
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
 static void
 init(void)
 {
   D3("Initializing the ega library");
-  backend_open();
 #ifdef DEBUG
   openlog (syslog_name, (LOG_CONS|LOG_NDELAY|LOG_PID), 0);
 #endif
+  backend_open();
 }
 
+/*
+ * Destructor when the library is unloaded
+ *
+ * See: http://man7.org/linux/man-pages/man3/dlopen.3.html
+ *
+ */
 __attribute__((destructor))
 static void
 destroy(void)
@@ -51,21 +181,112 @@ destroy(void)
   backend_close(); 
 }
 
-inline bool
+/* Returns the value of an integer pragma, or -1 */
+static int
+_pragma_int(const char* pragma)
+{
+  sqlite3_stmt *stmt = NULL;
+  int value = -1;
+  sqlite3_prepare_v2(db, pragma, -1, &stmt, NULL);
+  if(stmt && sqlite3_step(stmt) == SQLITE_ROW) value = sqlite3_column_int(stmt, 0);
+  sqlite3_finalize(stmt);
+  return value;
+}
+
+static inline int
+_schema_version(void)
+{
+  return _pragma_int("PRAGMA user_version");
+}
+
+/*
+ * Bring the schema up to date, in a single write transaction.
+ * Up-to-date databases are only read, so unprivileged processes can open them.
+ */
+static int
+_migrate(void)
+{
+  int version = _schema_version();
+  int rc = 1;
+  char* errmsg = NULL;
+
+  if(version < 0){ D1("Could not read the schema version: %s", sqlite3_errmsg(db)); return 1; }
+  if(version >= EGA_SCHEMA_VERSION){ D2("Schema up to date [version %d]", version); return 0; }
+
+  if(sqlite3_exec(db, "BEGIN IMMEDIATE", NULL, NULL, &errmsg) != SQLITE_OK){ D1("Could not start the migration: %s", errmsg); goto BAILOUT; }
+
+  /* Another process might have migrated it in the meantime */
+  version = _schema_version();
+
+  for(; version < EGA_SCHEMA_VERSION; version++){
+    D1("Migrating the database schema from version %d to %d", version, version + 1);
+    if(version == 0){
+      char schema[1000]; /* Laaaarge enough! */
+      sprintf(schema, EGA_SCHEMA_FMT, options->uid_shift);
+      rc = sqlite3_exec(db, schema, NULL, NULL, &errmsg);
+    } else {
+      rc = sqlite3_exec(db, migrations[version], NULL, NULL, &errmsg);
+    }
+    if(rc != SQLITE_OK){ D1("ERROR migrating to version %d: %s", version + 1, errmsg); goto ROLLBACK; }
+  }
+
+  char pragma[64];
+  sprintf(pragma, "PRAGMA user_version = %d", EGA_SCHEMA_VERSION);
+  if(sqlite3_exec(db, pragma, NULL, NULL, &errmsg) != SQLITE_OK){ D1("ERROR updating the schema version: %s", errmsg); goto ROLLBACK; }
+  if(sqlite3_exec(db, "COMMIT", NULL, NULL, &errmsg) != SQLITE_OK){ D1("ERROR committing the migration: %s", errmsg); goto ROLLBACK; }
+  rc = 0;
+  goto BAILOUT;
+
+ROLLBACK:
+  rc = 1;
+  sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+BAILOUT:
+  if(errmsg) sqlite3_free(errmsg);
+  return rc;
+}
+
+/* Opens the backend, if not done yet */
+bool
 backend_opened(void)
 {
+  pthread_once(&init_once, init);
   return db != NULL && sqlite3_errcode(db) == SQLITE_OK;
 }
 
+/*
+ * Busy handler: sleep 1, 2, 4... up to BUSY_PAUSE_MAX ms between attempts,
+ * for at most db_busy_timeout ms in total.
+ * SQLite's own busy timeout ends up sleeping 100ms at a time,
+ * often while the lock is already free.
+ */
+#define BUSY_PAUSE_MAX 16 /* ms */
+
+static int
+_busy_handler(void* arg, int count)
+{
+  unsigned int waited = 0, pause = 1; /* ms */
+  int i;
+  for(i = 0; i < count; i++){
+    waited += pause;
+    if(pause < BUSY_PAUSE_MAX) pause <<= 1;
+  }
+  if(waited >= options->db_busy_timeout){ D1("Database busy for %u ms: giving up", waited); return 0; }
+  usleep(pause * 1000);
+  return 1; /* try again */
+}
+
 void
 backend_open(void)
 {
   D2("Opening backend");
   if( !loadconfig() ){ REPORT("Invalid configuration"); return; }
-  if( backend_opened() ){ D1("Already opened"); return; }
+  if( db != NULL && sqlite3_errcode(db) == SQLITE_OK ){ D1("Already opened"); return; }
 
-  D1("Connection to: %s", options->db_path);
-  sqlite3_open(options->db_path, &db); /* owned by root and rw-r--r-- */
+  /* Only root updates the cache. The other processes only look users up */
+  int flags = (getuid() == 0)?(SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE):SQLITE_OPEN_READONLY;
+
+  D1("Connection to: %s%s", options->db_path, (flags & SQLITE_OPEN_READONLY)?" [read-only]":"");
+  sqlite3_open_v2(options->db_path, &db, flags, NULL); /* owned by root and rw-r--r-- */
   if (db == NULL){ D1("Failed to allocate database handle"); return; }
   D3("DB Connection: %p", db);
   
@@ -74,25 +295,139 @@ backend_open(void)
     return;
   }
   
-  /* create table */
-  D2("Creating the database schema");
-  sqlite3_stmt *stmt;
-  char schema[1000]; /* Laaaarge enough! */
-  sprintf(schema, EGA_SCHEMA_FMT, options->uid_shift);
-  sqlite3_prepare_v2(db, schema, -1, &stmt, NULL);
-  if (!stmt || sqlite3_step(stmt) != SQLITE_DONE) { D1("ERROR creating table: %s", sqlite3_errmsg(db)); }
-  sqlite3_finalize(stmt);
+  /* Sleep and retry, instead of failing, when another process holds the lock */
+  sqlite3_busy_handler(db, _busy_handler, NULL);
+
+  /*
+   * Write-ahead log: readers do not block the writer, nor the writer the readers.
+   * The WAL files are kept when closing, so that the processes
+   * which cannot write to the database can still open it.
+   */
+  if( !sqlite3_db_readonly(db, "main") ){
+    /*
+     * Keep the files compact after a purge (see backend_purge).
+     * auto_vacuum only applies to a new database: it must be set before anything is written,
+     * the switch to WAL included. The WAL file is truncated back to 4MB after a checkpoint.
+     */
+    if(sqlite3_exec(db, "PRAGMA auto_vacuum=INCREMENTAL; PRAGMA journal_size_limit=4194304", NULL, NULL, NULL) != SQLITE_OK){
+      D1("Could not set the vacuum mode: %s", sqlite3_errmsg(db));
+    }
+    int persist = 1;
+    sqlite3_file_control(db, "main", SQLITE_FCNTL_PERSIST_WAL, &persist);
+    if(sqlite3_exec(db, "PRAGMA journal_mode=WAL", NULL, NULL, NULL) != SQLITE_OK){
+      D1("Could not switch to WAL: %s", sqlite3_errmsg(db));
+    }
+  }
+
+  /* Storage profile: the cache can be rebuilt from CentralEGA, so it does not need FULL durability */
+  char* pragmas = sqlite3_mprintf("PRAGMA mmap_size=%u; PRAGMA cache_size=-%u; PRAGMA synchronous=%s;",
+				  options->db_mmap_size, options->db_cache_size, options->db_synchronous);
+  if(!pragmas || sqlite3_exec(db, pragmas, NULL, NULL, NULL) != SQLITE_OK){
+    D1("Could not set the storage profile: %s", sqlite3_errmsg(db));
+  }
+  sqlite3_free(pragmas);
+
+  /* create or update the schema */
+  D2("Checking the database schema");
+  _migrate();
+
+  /* prepare the statements */
+  D2("Preparing the statements");
+  int i;
+  for(i = 0; i < STMT_COUNT; i++){
+    if(sqlite3_prepare_v3(db, stmts_sql[i], -1, SQLITE_PREPARE_PERSISTENT, &stmts[i], NULL) != SQLITE_OK){
+      D1("Prepared statement error [%d]: %s", i, sqlite3_errmsg(db));
+    }
+  }
 }
 
 void
 backend_close(void)
 {
   D2("Closing database backend");
-  if(db) sqlite3_close(db);
+  int i;
+  for(i = 0; i < STMT_COUNT; i++){
+    if(stmts[i]){ sqlite3_finalize(stmts[i]); stmts[i] = NULL; }
+  }
+  if(db){ sqlite3_close(db); db = NULL; }
   cleanconfig();
 }
 
 
+static bool batch = false; /* see backend_batch_begin */
+static bool index_dirty = false; /* see backend_refresh_index */
+
+/* The users added in the batch, for the shared cache segment once committed */
+struct shm_pending_s {
+  char* username;
+  uid_t uid;
+  char* gecos;
+  char* pubkey;
+  time_t expires;
+};
+static struct shm_pending_s* shm_pending = NULL;
+static size_t shm_npending = 0;
+static size_t shm_cap = 0;
+
+static char* _strdup_null(const char* s){ return (s)?strdup(s):NULL; }
+
+/* Keeps the user for _shm_publish. If it cannot, the shared segment goes without it */
+static void
+_shm_defer(const char* username, uid_t uid, const char* gecos, const char* pubkey, time_t expires)
+{
+  if(shm_npending == shm_cap){
+    size_t cap = (shm_cap)?(shm_cap * 2):64;
+    struct shm_pending_s* p = realloc(shm_pending, cap * sizeof(struct shm_pending_s));
+    if(!p){ D1("Memory allocation error: %s left out of the shared cache", username); return; }
+    shm_pending = p;
+    shm_cap = cap;
+  }
+  struct shm_pending_s* e = &shm_pending[shm_npending];
+  e->username = strdup(username);
+  e->gecos = _strdup_null(gecos);
+  e->pubkey = _strdup_null(pubkey);
+  if(!e->username || (gecos && !e->gecos) || (pubkey && !e->pubkey)){
+    D1("Memory allocation error: %s left out of the shared cache", username);
+    free(e->username); free(e->gecos); free(e->pubkey);
+    return;
+  }
+  e->uid = uid;
+  e->expires = expires;
+  shm_npending++;
+}
+
+/* Puts the users of the batch in the shared segment, once committed, or forgets them */
+static void
+_shm_publish(bool committed)
+{
+  size_t k;
+  for(k = 0; k < shm_npending; k++){
+    struct shm_pending_s* e = &shm_pending[k];
+    if(committed) shmcache_add(e->username, e->uid, e->gecos, e->pubkey, e->expires);
+    free(e->username); free(e->gecos); free(e->pubkey);
+  }
+  free(shm_pending);
+  shm_pending = NULL;
+  shm_npending = shm_cap = 0;
+}
+
+/*
+ * Expiration date of a new entry
+ *
+ * Entries added together (after a restart, or a bulk warm-up) would all expire
+ * in the same second, and the next logins would reach CentralEGA all at once.
+ * So up to cache_ttl_jitter percent of the ttl is taken off, pseudo-randomly
+ * per user, per second and per process.
+ */
+static unsigned int
+_expiration(const char* username, unsigned int now)
+{
+  uint64_t span = (uint64_t)options->cache_ttl * options->cache_ttl_jitter / 100;
+  if(!span) return now + options->cache_ttl;
+  uint32_t r = (hash_str(username) ^ now ^ (uint32_t)getpid()) * 2654435761u; /* Knuth */
+  return now + options->cache_ttl - (unsigned int)(((uint64_t)r * (span + 1)) >> 32); /* [0, span] */
+}
+
 /*
  * Assumes config file already loaded and backend open
  */
@@ -103,13 +438,11 @@ backend_add_user(const char* username,
 		 const char* pubkey,
 		 const char* gecos)
 {
-  sqlite3_stmt *stmt = NULL;
-
   D1("Insert %s into cache", username);
 
   /* The entry will be updated if already present */
-  sqlite3_prepare_v2(db, "INSERT INTO users (username,uid,pwdh,pubkey,gecos,expires) VALUES(?1,?2,?3,?4,?5,?6)", -1, &stmt, NULL);
-  if(!stmt){ D1("Prepared statement error: %s", sqlite3_errmsg(db)); return false; }
+  sqlite3_stmt *stmt = _get_stmt(STMT_ADD_USER);
+  if(!stmt){ return false; }
 
   sqlite3_bind_text(stmt,   1, username, -1, SQLITE_STATIC);
   sqlite3_bind_int(stmt,    2, uid                        );
@@ -118,25 +451,87 @@ backend_add_user(const char* username,
   sqlite3_bind_text(stmt,   5, gecos   , -1, SQLITE_STATIC);
   
   unsigned int now = (unsigned int)time(NULL);
-  unsigned int expiration = now + options->cache_ttl;
+  unsigned int expiration = _expiration(username, now);
   D2("           Current time to %u", now);
   D2("Setting expiration date to %u", expiration);
   sqlite3_bind_int(stmt, 6, expiration);
 
-  /* We should acquire a RESERVED lock.
-     See: https://www.sqlite.org/lockingv3.html#writing
-     When the lock is taken, the database returns SQLITE_BUSY.
-     So...
-     That should be ok with a busy-loop. (Alternative: sleep(0.5)).
-     It is highly unlikely that this process will starve.
-     All other process will not keep the database busy forever.
-  */
-  while( sqlite3_step(stmt) == SQLITE_BUSY ); // a RESERVED lock is taken
-
-  /* Execute the query. */
+  /* The passwd entry, ready to be copied. Without it, lookups build it field by field */
+  size_t entlen = pwent_size(username, gecos);
+  _cleanup_str_ char* ent = (entlen)?malloc(entlen):NULL;
+  if(ent){
+    pwent_fill((struct pwent_s*)ent, username, uid, gecos);
+    sqlite3_bind_blob(stmt, 7, ent, entlen, SQLITE_STATIC);
+  }
+
+  /* Waits (see db_busy_timeout) if another process is writing */
   int rc = (sqlite3_step(stmt) == SQLITE_DONE)?0:1;
   if(rc) D1("Execution error: %s", sqlite3_errmsg(db));
-  sqlite3_finalize(stmt);
+  _put_stmt(stmt);
+  _lru_flush();
+  if(rc) return rc;
+  if(batch) _shm_defer(username, uid, gecos, pubkey, expiration); /* not before the commit */
+  else shmcache_add(username, uid, gecos, pubkey, expiration);
+  __atomic_store_n(&index_dirty, true, __ATOMIC_RELAXED);
+  return rc;
+}
+
+/*
+ * Batches
+ *
+ * The backend_add_user calls between backend_batch_begin and backend_batch_end
+ * run in a single transaction. They get in the shared cache segment once it
+ * is committed, and not at all when it is rolled back.
+ * Meanwhile, other writers wait (see db_busy_timeout), so keep batches short:
+ * do not contact CentralEGA in the middle of one.
+ * Not meant for several threads at once.
+ */
+int
+backend_batch_begin(void)
+{
+  char* errmsg = NULL;
+  if(batch){ D1("Batch already started"); return 1; }
+  if(sqlite3_exec(db, "BEGIN IMMEDIATE", NULL, NULL, &errmsg) != SQLITE_OK){
+    D1("Could not start the batch: %s", errmsg);
+    sqlite3_free(errmsg);
+    return 1;
+  }
+  batch = true;
+  return 0;
+}
+
+int
+backend_batch_end(void)
+{
+  char* errmsg = NULL;
+  int rc = 0;
+  if(!batch){ D1("No batch started"); return 1; }
+  batch = false;
+  if(sqlite3_exec(db, "COMMIT", NULL, NULL, &errmsg) != SQLITE_OK){
+    D1("Could not commit the batch: %s", errmsg);
+    sqlite3_free(errmsg);
+    sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+    rc = 1;
+  }
+  _shm_publish(rc == 0);
+  _lru_flush();
+  return rc;
+}
+
+int
+backend_batch_abort(void)
+{
+  char* errmsg = NULL;
+  int rc = 0;
+  if(!batch){ D1("No batch started"); return 1; }
+  batch = false;
+  if(sqlite3_exec(db, "ROLLBACK", NULL, NULL, &errmsg) != SQLITE_OK){
+    D1("Could not roll the batch back: %s", errmsg);
+    sqlite3_free(errmsg);
+    rc = 1;
+  }
+  _shm_publish(false);
+  _lru_flush(); /* it might hold rows from the batch */
   return rc;
 }
 
@@ -168,19 +563,161 @@ _col2txt(sqlite3_stmt *stmt, int col, char** data, char **buffer, size_t* buflen
  *         error otherwise
  *
  * Note: Those functions ignore the expiration column
+ *
+ * When the row holds a passwd entry built with the current settings,
+ * it is copied as is. Otherwise, it is converted field by field.
  */
 
+/*
+ * In-process LRU, in front of the users table
+ *
+ * Long-running processes (sshd, ls -l in the inbox, backups...) look up
+ * the same few users over and over. We keep the last ones, pre-serialized,
+ * in a few fixed slots, for at most cache_ttl seconds.
+ * They are all dropped when the database changes: on our own writes,
+ * and when another connection committed, which "PRAGMA data_version" tells.
+ * That costs about half a lookup, so we check it at most once per second.
+ */
+#define LRU_SLOTS 16
+#define LRU_ENTRY_MAX 512 /* bytes. Larger entries are not kept */
+
+struct lru_slot_s {
+  uint64_t used;       /* last use, 0 when empty */
+  time_t expires;
+  uint32_t hash;       /* of the username */
+  size_t len;
+  char ent[LRU_ENTRY_MAX] __attribute__((aligned(8))); /* struct pwent_s */
+};
+
+static pthread_mutex_t lru_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct lru_slot_s lru[LRU_SLOTS];
+static uint64_t lru_clock = 0;
+static time_t lru_checked = 0;
+static int lru_version = -1;
+
+static void
+_lru_flush(void)
+{
+  pthread_mutex_lock(&lru_lock);
+  int i;
+  for(i = 0; i < LRU_SLOTS; i++) lru[i].used = 0;
+  lru_checked = 0;
+  lru_version = -1;
+  pthread_mutex_unlock(&lru_lock);
+}
+
+/* Called with the lock */
+static void
+_lru_check(time_t now)
+{
+  if(lru_checked == now) return;
+  lru_checked = now;
+
+  sqlite3_stmt *stmt = _get_stmt(STMT_DATA_VERSION);
+  int version = (stmt && sqlite3_step(stmt) == SQLITE_ROW)?sqlite3_column_int(stmt, 0):-1;
+  if(stmt) _put_stmt(stmt);
+  if(version != lru_version || version < 0){
+    D3("Database changed: flushing the LRU");
+    int i;
+    for(i = 0; i < LRU_SLOTS; i++) lru[i].used = 0;
+    lru_version = version;
+  }
+}
+
+/* Same return values as below */
+static int
+_lru_get(const char* username, uid_t uid, struct passwd *result, char *buffer, size_t buflen)
+{
+  int rc = 1;
+  time_t now = time(NULL);
+  uint32_t h = (username)?hash_str(username):0;
+
+  pthread_mutex_lock(&lru_lock);
+  _lru_check(now);
+  int i;
+  for(i = 0; i < LRU_SLOTS; i++){
+    struct lru_slot_s* slot = &lru[i];
+    const struct pwent_s* ent = (const struct pwent_s*)slot->ent;
+    if(!slot->used || slot->expires <= now) continue;
+    if( (username)?(slot->hash != h || strcmp(ent->data, username)):(ent->uid != uid) ) continue;
+    rc = pwent_copy(ent, slot->len, result, buffer, buflen);
+    if(rc == 0) slot->used = ++lru_clock;
+    break;
+  }
+  pthread_mutex_unlock(&lru_lock);
+  return rc;
+}
+
+static void
+_lru_put(const struct passwd *pw)
+{
+  size_t len = pwent_size(pw->pw_name, pw->pw_gecos);
+  if(!len || len > LRU_ENTRY_MAX) return;
+
+  pthread_mutex_lock(&lru_lock);
+  struct lru_slot_s* victim = &lru[0];
+  int i;
+  for(i = 0; i < LRU_SLOTS; i++){
+    struct lru_slot_s* slot = &lru[i];
+    if(slot->used && ((const struct pwent_s*)slot->ent)->uid == pw->pw_uid){ victim = slot; break; } /* replace */
+    if(slot->used < victim->used) victim = slot; /* empty ones first */
+  }
+  pwent_fill((struct pwent_s*)victim->ent, pw->pw_name, pw->pw_uid, pw->pw_gecos);
+  victim->len = len;
+  victim->hash = hash_str(pw->pw_name);
+  victim->expires = time(NULL) + options->cache_ttl;
+  victim->used = ++lru_clock;
+  pthread_mutex_unlock(&lru_lock);
+}
+
+/*
+ * Last access, for the eviction (see backend_purge)
+ *
+ * Only tracked when cache_max_entries is set, and only by root, since it is a write.
+ * We update it at most once every ACCESS_RESOLUTION seconds per user.
+ * Hits in the LRU, the index or the shared memory cache are not counted:
+ * the entries they serve were looked up in the database at some point.
+ */
+#define ACCESS_RESOLUTION 300 /* seconds */
+
+/* Called once the statement is released */
+static void
+_touch(const char* username, double accessed)
+{
+  if(!options->cache_max_entries || accessed > (double)time(NULL) - ACCESS_RESOLUTION) return;
+  if(sqlite3_db_readonly(db, "main")) return;
+
+  sqlite3_stmt *stmt = _get_stmt(STMT_TOUCH);
+  if(!stmt){ return; }
+  sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+  if(sqlite3_step(stmt) != SQLITE_DONE) D1("Execution error: %s", sqlite3_errmsg(db));
+  _put_stmt(stmt);
+}
+
+static inline int
+_col2pwent(sqlite3_stmt *stmt, int col, struct passwd *result, char *buffer, size_t buflen)
+{
+  const void* ent = sqlite3_column_blob(stmt, col); /* before sqlite3_column_bytes */
+  return pwent_copy(ent, sqlite3_column_bytes(stmt, col), result, buffer, buflen);
+}
+
 int backend_getpwuid_r(uid_t uid, struct passwd *result, char *buffer, size_t buflen)
 {
-  sqlite3_stmt *stmt = NULL;
-  int rc = 1; /* cache miss */
-  D2("select username,uid,gecos from users where uid = %u LIMIT 1", uid);
-  sqlite3_prepare_v2(db, "select username,uid,gecos from users where uid = ?1 LIMIT 1", -1, &stmt, NULL);
-  if(stmt == NULL){ D1("Prepared statement error: %s", sqlite3_errmsg(db)); return rc; }
+  int rc = _lru_get(NULL, uid, result, buffer, buflen);
+  if(rc <= 0) return rc;
+
+  /* rc == 1: cache miss */
+  double accessed = 0;
+  D2("select username,uid,gecos,pwent,accessed from users where uid = %u LIMIT 1", uid);
+  sqlite3_stmt *stmt = _get_stmt(STMT_GETPWUID);
+  if(stmt == NULL){ return rc; }
   sqlite3_bind_int(stmt, 1, uid);
 
   /* cache miss */
   if(sqlite3_step(stmt) != SQLITE_ROW) { D2("No SQL row"); goto BAILOUT; }
+  accessed = sqlite3_column_double(stmt, 4);
+
+  if( (rc = _col2pwent(stmt, 3, result, buffer, buflen)) <= 0 ) goto BAILOUT;
 
   /* Convert to struct PWD */
   if( (rc = _col2txt(stmt, 0, &(result->pw_name), &buffer, &buflen)) ) goto BAILOUT;
@@ -195,22 +732,29 @@ int backend_getpwuid_r(uid_t uid, struct passwd *result, char *buffer, size_t bu
 
   /* success */ rc = 0;
 BAILOUT:
-  sqlite3_finalize(stmt);
+  _put_stmt(stmt);
+  if(rc == 0){ _lru_put(result); _touch(result->pw_name, accessed); }
   return rc;
 };
 
 int
 backend_getpwnam_r(const char* username, struct passwd *result, char* buffer, size_t buflen)
 {
-  sqlite3_stmt *stmt = NULL;
-  int rc = 1; /* cache miss */
-  D2("select username,uid,gecos from users where username = '%s' LIMIT 1", username);
-  sqlite3_prepare_v2(db, "select username,uid,gecos from users where username = ?1 LIMIT 1", -1, &stmt, NULL);
-  if(stmt == NULL){ D1("Prepared statement error: %s", sqlite3_errmsg(db)); return false; }
+  int rc = _lru_get(username, 0, result, buffer, buflen);
+  if(rc <= 0) return rc;
+
+  /* rc == 1: cache miss */
+  double accessed = 0;
+  D2("select username,uid,gecos,pwent,accessed from users where username = '%s' LIMIT 1", username);
+  sqlite3_stmt *stmt = _get_stmt(STMT_GETPWNAM);
+  if(stmt == NULL){ return rc; }
   sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
 
   /* cache miss */
   if(sqlite3_step(stmt) != SQLITE_ROW) { D2("No SQL row"); goto BAILOUT; }
+  accessed = sqlite3_column_double(stmt, 4);
+
+  if( (rc = _col2pwent(stmt, 3, result, buffer, buflen)) <= 0 ) goto BAILOUT;
 
   /* Convert to struct PWD */
   result->pw_name = (char*)username;
@@ -226,7 +770,8 @@ backend_getpwnam_r(const char* username, struct passwd *result, char* buffer, si
 
   /* success */ rc = 0;
 BAILOUT:
-  sqlite3_finalize(stmt);
+  _put_stmt(stmt);
+  if(rc == 0){ _lru_put(result); _touch(result->pw_name, accessed); }
   return rc;
 }
 
@@ -235,81 +780,446 @@ BAILOUT:
  *
  * The following functions do check the expiration date (in SQL)
  *
+ * Within the grace window (cache_grace seconds after the expiration date),
+ * an expired entry is still served, and refreshed in the background.
+ *
+ * Refresh-ahead: an entry hit within the last cache_refresh_ahead percent
+ * of its ttl is refreshed in the background too, so that it does not expire.
+ *
  */
 
+/* Called once the statement is released */
+static inline void
+_revalidate(const char* username, bool stale)
+{
+  if(!stale) return;
+  D1("Serving an entry for %s, expired or about to", username);
+  refresh_user(username);
+}
+
+/* How long before its expiration date an entry is refreshed (in seconds) */
+static inline double
+_ahead(void)
+{
+  return (double)options->cache_ttl * options->cache_refresh_ahead / 100;
+}
+
+static inline bool
+_is_stale(sqlite3_stmt *stmt, int col)
+{
+  return sqlite3_column_double(stmt, col) <= (double)time(NULL) + _ahead();
+}
+
 bool
 backend_print_pubkey(const char* username)
 {
-  sqlite3_stmt *stmt = NULL;
   int found = false; /* cache miss */
+  bool stale = false;
+  double accessed = 0;
 
-  D2("select pubkey from users where username = %s AND expires > strftime('%%s', 'now') LIMIT 1", username);
-  sqlite3_prepare_v2(db, "select pubkey from users where username = ?1 AND expires > strftime('%s', 'now') LIMIT 1", -1, &stmt, NULL);
-  if(stmt == NULL){ D1("Prepared statement error: %s", sqlite3_errmsg(db)); return false; }
+  D2("select pubkey from users where username = %s AND expires > strftime('%%s', 'now') - %u LIMIT 1", username, options->cache_grace);
+  sqlite3_stmt *stmt = _get_stmt(STMT_PUBKEY);
+  if(stmt == NULL){ return false; }
   sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt, 2, options->cache_grace);
   if(sqlite3_step(stmt) != SQLITE_ROW) { D2("No SQL row"); goto BAILOUT; } /* cache miss */
   if(sqlite3_column_type(stmt, 0) != SQLITE_TEXT){ D1("The colum 0 is not a string"); goto BAILOUT; }
   const unsigned char* pubkey = sqlite3_column_text(stmt, 0);
   if( !pubkey ){ D1("Memory allocation error"); goto BAILOUT; }
   printf("%s", pubkey);
   found = true; /* success */
+  stale = _is_stale(stmt, 1);
+  accessed = sqlite3_column_double(stmt, 2);
 BAILOUT:
-  sqlite3_finalize(stmt);
+  _put_stmt(stmt);
+  if(found) _touch(username, accessed);
+  _revalidate(username, stale);
   return found;
 }
 
 
+/* Fetch the public key from the database.
+ * Allocates a string into data. You have to clean it when you're done.
+ */
+bool
+backend_get_pubkey(const char* username, char** data){
+  int success = false; /* cache miss */
+  bool stale = false;
+  double accessed = 0;
+  D2("select pubkey from users where username = '%s' AND expires > strftime('%%s', 'now') - %u LIMIT 1", username, options->cache_grace);
+  sqlite3_stmt *stmt = _get_stmt(STMT_PUBKEY);
+  if(stmt == NULL){ return false; }
+  sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt, 2, options->cache_grace);
+  if(sqlite3_step(stmt) != SQLITE_ROW) { D2("No SQL row"); goto BAILOUT; } /* cache miss */
+  if(sqlite3_column_type(stmt, 0) != SQLITE_TEXT){ D1("The colum 0 is not a string"); goto BAILOUT; }
+  char* s = (char*)sqlite3_column_text(stmt, 0);
+  if( s == NULL ){ D1("Memory allocation error"); goto BAILOUT; }
+  *data = strdup(s);
+  success = (*data != NULL);
+  stale = success && _is_stale(stmt, 1);
+  accessed = sqlite3_column_double(stmt, 2);
+BAILOUT:
+  _put_stmt(stmt);
+  if(success) _touch(username, accessed);
+  _revalidate(username, stale);
+  return success;
+}
+
 /* Fetch the password hash from the database.
  * Allocates a string into data. You have to clean it when you're done.
  */
 bool
 backend_get_password_hash(const char* username, char** data){
-  sqlite3_stmt *stmt = NULL;
   int success = false; /* cache miss */
-  D2("select pwdh from users where username = '%s' AND expires > strftime('%%s', 'now') LIMIT 1", username);
-  sqlite3_prepare_v2(db, "select pwdh from users where username = ?1 AND expires > strftime('%s', 'now') LIMIT 1", -1, &stmt, NULL);
-  if(stmt == NULL){ D1("Prepared statement error: %s", sqlite3_errmsg(db)); return false; }
+  bool stale = false;
+  double accessed = 0;
+  D2("select pwdh from users where username = '%s' AND expires > strftime('%%s', 'now') - %u LIMIT 1", username, options->cache_grace);
+  sqlite3_stmt *stmt = _get_stmt(STMT_PWDH);
+  if(stmt == NULL){ return false; }
   sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt, 2, options->cache_grace);
   if(sqlite3_step(stmt) != SQLITE_ROW) { D2("No SQL row"); goto BAILOUT; } /* cache miss */
   if(sqlite3_column_type(stmt, 0) != SQLITE_TEXT){ D1("The colum 0 is not a string"); goto BAILOUT; }
   char* s = (char*)sqlite3_column_text(stmt, 0);
   if( s == NULL ){ D1("Memory allocation error"); goto BAILOUT; }
   *data = strdup(s);
   success = true;
+  stale = _is_stale(stmt, 1);
+  accessed = sqlite3_column_double(stmt, 2);
 BAILOUT:
-  sqlite3_finalize(stmt);
+  _put_stmt(stmt);
+  if(success) _touch(username, accessed);
+  _revalidate(username, stale);
   return success;
 }
 
 /*
- * Check if the cache entry has expired
+ * Returns the expiration date of the cache entry, or 0 if there is none
+ */
+static double
+_step_expires(sqlite3_stmt *stmt)
+{
+  double expires = 0;
+  if(sqlite3_step(stmt) == SQLITE_ROW) expires = sqlite3_column_double(stmt, 0);
+  _put_stmt(stmt);
+  return expires;
+}
+
+static double
+_expires(const char* username)
+{
+  sqlite3_stmt *stmt = _get_stmt(STMT_EXPIRES);
+  if(!stmt){ return 0; }
+  sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+  return _step_expires(stmt);
+}
+
+/*
+ * Check if the cache entry has expired (or is not there)
  */
 bool
 backend_has_expired(const char* username)
 {
-  sqlite3_stmt *stmt = NULL;
-  bool has_expired = false;
   D1("Check cache expiration for user %s", username);
 
-  /* The entry will be updated if already present */
-  sqlite3_prepare_v2(db, "SELECT count(*), expires, strftime('%s', 'now') FROM users WHERE username = ?1 AND expires > strftime('%s', 'now')", -1, &stmt, NULL);
-  if(!stmt){ D1("Prepared statement error: %s", sqlite3_errmsg(db)); return false; }
-  sqlite3_bind_text(stmt,   1, username, -1, SQLITE_STATIC);
+  double expires = _expires(username);
+  double now = (double)time(NULL);
 
-  /* Found it? */
-  if(sqlite3_step(stmt) != SQLITE_ROW) { D1("No SQL row, something is weird"); goto BAILOUT; }
-  if(sqlite3_column_type(stmt, 0) != SQLITE_INTEGER){ D1("The colum 0 is not an integer"); goto BAILOUT; }
+  if(expires > now){ _revalidate(username, expires <= now + _ahead()); return false; }
+  if(expires > now - options->cache_grace){ _revalidate(username, true); return false; }
 
-  D1("Just testing 1: %d", sqlite3_column_int(stmt, 0));
-  D1("Just testing 2: %d", sqlite3_column_int(stmt, 1));
-  D1("Just testing 3: %d", sqlite3_column_int(stmt, 2));
+  D2("Cache invalid for user %s", username);
+  return true;
+}
 
-  /* Either not found or has expired */
-  if (sqlite3_column_int(stmt, 0) == 0){ D2("Cache invalid for user %s", username); has_expired = true; }
-  
-BAILOUT:
-  sqlite3_finalize(stmt);
-  return has_expired;
+/*
+ * Check if the cache entry is there and is not due for a refresh,
+ * ignoring the grace window
+ */
+bool
+backend_is_fresh(const char* username)
+{
+  return _expires(username) > (double)time(NULL) + _ahead();
 }
 
+bool
+backend_is_fresh_uid(uid_t uid)
+{
+  sqlite3_stmt *stmt = _get_stmt(STMT_EXPIRES_UID);
+  if(!stmt){ return false; }
+  sqlite3_bind_int(stmt, 1, uid);
+  return _step_expires(stmt) > (double)time(NULL) + _ahead();
+}
 
+int
+backend_remove_user(const char* username)
+{
+  D1("Remove %s from the cache", username);
+  sqlite3_stmt *stmt = _get_stmt(STMT_REMOVE_USER);
+  if(!stmt){ return 1; }
+  sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+  int rc = (sqlite3_step(stmt) == SQLITE_DONE)?0:1;
+  if(rc) D1("Execution error: %s", sqlite3_errmsg(db));
+  _put_stmt(stmt);
+  _lru_flush();
+  shmcache_remove(username);
+  if(!rc) __atomic_store_n(&index_dirty, true, __ATOMIC_RELAXED);
+  return rc;
+}
+
+/*
+ * Rebuild the NSS lookup index from the users table (see index.h).
+ * Does nothing when index_path is not set.
+ *
+ * It is a full scan, so it is never done on a lookup or an insert:
+ * ega_cache_warm rebuilds it after its run, and ega-authd every
+ * INDEX_INTERVAL seconds at most, when the cache changed (see backend_refresh_index).
+ */
+#define INDEX_INTERVAL 10 /* seconds */
+
+static int index_version = -1; /* PRAGMA data_version, at the last rebuild */
+
+int
+backend_update_index(void)
+{
+  __atomic_store_n(&index_dirty, false, __ATOMIC_RELAXED);
+  sqlite3_stmt *stmt = _get_stmt(STMT_DATA_VERSION);
+  index_version = (stmt && sqlite3_step(stmt) == SQLITE_ROW)?sqlite3_column_int(stmt, 0):-1;
+  if(stmt) _put_stmt(stmt);
+
+  if( index_begin() ) return 0; /* disabled */
+
+  D2("Rebuilding the lookup index");
+  stmt = _get_stmt(STMT_ALL_USERS);
+  if(stmt){
+    while(sqlite3_step(stmt) == SQLITE_ROW){
+      /* Ignore the ones we can't add: they are looked up in the database */
+      index_add((const char*)sqlite3_column_text(stmt, 0),
+		(uid_t)sqlite3_column_int(stmt, 1),
+		(const char*)sqlite3_column_text(stmt, 2));
+    }
+    _put_stmt(stmt);
+  }
+  return index_commit();
+}
+
+/*
+ * Rebuild the index if the cache changed since the last rebuild:
+ * through us, or another connection, which "PRAGMA data_version" tells.
+ * At most once every INDEX_INTERVAL seconds.
+ */
+int
+backend_refresh_index(void)
+{
+  static time_t rebuilt = 0;
+  time_t now = time(NULL);
+
+  if(!options->index_path || now < rebuilt + INDEX_INTERVAL) return 0;
+
+  bool changed = __atomic_load_n(&index_dirty, __ATOMIC_RELAXED);
+  if(!changed){
+    sqlite3_stmt *stmt = _get_stmt(STMT_DATA_VERSION);
+    int version = (stmt && sqlite3_step(stmt) == SQLITE_ROW)?sqlite3_column_int(stmt, 0):-1;
+    if(stmt) _put_stmt(stmt);
+    changed = (version != index_version || version < 0);
+  }
+  if(!changed) return 0;
+
+  rebuilt = now;
+  return backend_update_index();
+}
+
+
+
+/*
+ * Purge
+ *
+ * Entries expired for longer than cache_grace are no longer served,
+ * and the least recently accessed ones go when there are more than cache_max_entries.
+ * Deletions are done PURGE_BATCH rows at a time, each in its own transaction,
+ * so that a login refreshing its entry waits at most for one batch.
+ * Lookups never wait: in WAL mode, readers are not blocked by the writer.
+ */
+#define PURGE_BATCH 256 /* rows, or pages for the vacuum */
+
+/*
+ * Whether the last purge, by any process, is older than cache_purge_interval.
+ * Each process checks at most once per interval.
+ */
+bool
+backend_purge_due(void)
+{
+  static time_t checked = 0;
+
+  if(!options->cache_purge_interval || sqlite3_db_readonly(db, "main")) return false;
+
+  time_t now = time(NULL);
+  time_t last = __atomic_load_n(&checked, __ATOMIC_RELAXED);
+  if(last && now < last + (time_t)options->cache_purge_interval) return false;
+  if(!__atomic_compare_exchange_n(&checked, &last, now, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) return false; /* another thread */
+
+  double purged = 0;
+  sqlite3_stmt *stmt = _get_stmt(STMT_PURGED);
+  if(!stmt){ return false; }
+  if(sqlite3_step(stmt) == SQLITE_ROW) purged = sqlite3_column_double(stmt, 0);
+  _put_stmt(stmt);
+  return purged <= (double)(now - options->cache_purge_interval);
+}
+
+/* Returns the number of changed rows, or -1 */
+static int
+_changes(sqlite3_stmt *stmt)
+{
+  int n = (sqlite3_step(stmt) == SQLITE_DONE)?sqlite3_changes(db):-1;
+  if(n < 0) D1("Execution error: %s", sqlite3_errmsg(db));
+  _put_stmt(stmt);
+  return n;
+}
+
+int
+backend_purge(void)
+{
+  time_t now = time(NULL);
+  int n, purged = 0, evicted = 0;
+
+  /* Claim it: only one process purges per interval */
+  sqlite3_stmt *stmt = _get_stmt(STMT_CLAIM_PURGE);
+  if(!stmt){ return 1; }
+  sqlite3_bind_int64(stmt, 1, now);
+  sqlite3_bind_int64(stmt, 2, now - options->cache_purge_interval);
+  if(_changes(stmt) <= 0){ D2("Purge already done"); return 0; }
+
+  D1("Purging the cache");
+  do {
+    if(!(stmt = _get_stmt(STMT_PURGE_USERS))) break;
+    sqlite3_bind_int(stmt, 1, options->cache_grace);
+    sqlite3_bind_int(stmt, 2, PURGE_BATCH);
+    if((n = _changes(stmt)) > 0) purged += n;
+  } while(n == PURGE_BATCH);
+
+  while(options->cache_max_entries){
+    if(!(stmt = _get_stmt(STMT_EVICT_USERS))) break;
+    sqlite3_bind_int(stmt, 1, options->cache_max_entries);
+    sqlite3_bind_int(stmt, 2, PURGE_BATCH);
+    if((n = _changes(stmt)) > 0) evicted += n;
+    if(n < PURGE_BATCH) break;
+  }
+
+  if((stmt = _get_stmt(STMT_PURGE_UNKNOWN_USERS))) _changes(stmt);
+  if((stmt = _get_stmt(STMT_PURGE_UNKNOWN_UIDS))) _changes(stmt);
+
+  D1("Purged %d expired entries, evicted %d", purged, evicted);
+  if(purged || evicted){
+    _lru_flush();
+    backend_update_index();
+  }
+
+  /* Give the free pages back to the filesystem (new databases only, see backend_open) */
+  if(_pragma_int("PRAGMA auto_vacuum") == 2){
+    char* vacuum = sqlite3_mprintf("PRAGMA incremental_vacuum(%d)", PURGE_BATCH);
+    int before, after;
+    for(before = _pragma_int("PRAGMA freelist_count"); vacuum && before > 0; before = after){
+      if(sqlite3_exec(db, vacuum, NULL, NULL, NULL) != SQLITE_OK){ D1("Vacuum error: %s", sqlite3_errmsg(db)); break; }
+      if((after = _pragma_int("PRAGMA freelist_count")) >= before) break;
+    }
+    sqlite3_free(vacuum);
+  }
+
+  /* Fold the WAL into the database, without waiting for the readers */
+  if(sqlite3_wal_checkpoint_v2(db, NULL, SQLITE_CHECKPOINT_PASSIVE, NULL, NULL) != SQLITE_OK){
+    D1("Checkpoint error: %s", sqlite3_errmsg(db));
+  }
+  return 0;
+}
+
+/*
+ * Delta sync watermark: when the last successful sync started.
+ * Kept in the database, so that any process can carry on the sync.
+ */
+time_t
+backend_synced(void)
+{
+  time_t synced = 0; /* never */
+  sqlite3_stmt *stmt = _get_stmt(STMT_SYNCED);
+  if(!stmt){ return 0; }
+  if(sqlite3_step(stmt) == SQLITE_ROW) synced = (time_t)sqlite3_column_int64(stmt, 0);
+  _put_stmt(stmt);
+  return synced;
+}
+
+int
+backend_set_synced(time_t synced)
+{
+  sqlite3_stmt *stmt = _get_stmt(STMT_SET_SYNCED);
+  if(!stmt){ return 1; }
+  sqlite3_bind_int64(stmt, 1, synced);
+  return (_changes(stmt) < 0)?1:0;
+}
+
+/*
+ * Negative cache: users and user ids that CentralEGA does not know.
+ * Disabled when negative_cache_ttl is 0.
+ */
+
+static int
+_add_unknown(sqlite3_stmt *stmt)
+{
+  unsigned int expiration = (unsigned int)time(NULL) + options->negative_cache_ttl;
+  D2("Setting expiration date to %u", expiration);
+  sqlite3_bind_int(stmt, 2, expiration);
+  int rc = (sqlite3_step(stmt) == SQLITE_DONE)?0:1;
+  if(rc) D1("Execution error: %s", sqlite3_errmsg(db));
+  _put_stmt(stmt);
+  return rc;
+}
+
+static bool
+_is_unknown(sqlite3_stmt *stmt)
+{
+  bool unknown = (sqlite3_step(stmt) == SQLITE_ROW);
+  _put_stmt(stmt);
+  return unknown;
+}
+
+int
+backend_add_unknown_user(const char* username)
+{
+  if(!options->negative_cache_ttl) return 0;
+  D1("Insert %s into the negative cache", username);
+  sqlite3_stmt *stmt = _get_stmt(STMT_ADD_UNKNOWN_USER);
+  if(!stmt){ return 1; }
+  sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+  return _add_unknown(stmt);
+}
+
+int
+backend_add_unknown_uid(uid_t uid)
+{
+  if(!options->negative_cache_ttl) return 0;
+  D1("Insert user id %u into the negative cache", uid);
+  sqlite3_stmt *stmt = _get_stmt(STMT_ADD_UNKNOWN_UID);
+  if(!stmt){ return 1; }
+  sqlite3_bind_int(stmt, 1, uid);
+  return _add_unknown(stmt);
+}
+
+bool
+backend_is_unknown_user(const char* username)
+{
+  if(!options->negative_cache_ttl) return false;
+  sqlite3_stmt *stmt = _get_stmt(STMT_IS_UNKNOWN_USER);
+  if(!stmt){ return false; }
+  sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+  return _is_unknown(stmt);
+}
+
+bool
+backend_is_unknown_uid(uid_t uid)
+{
+  if(!options->negative_cache_ttl) return false;
+  sqlite3_stmt *stmt = _get_stmt(STMT_IS_UNKNOWN_UID);
+  if(!stmt){ return false; }
+  sqlite3_bind_int(stmt, 1, uid);
+  return _is_unknown(stmt);
+}
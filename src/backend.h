@@ -17,13 +17,37 @@ int backend_add_user(const char* username,
 		     const char* pubkey,
 		     const char* gecos);
 
+/* Many backend_add_user calls in one transaction. All return 0 on success.
+ * backend_batch_abort rolls them back */
+int backend_batch_begin(void);
+int backend_batch_end(void);
+int backend_batch_abort(void);
+
 int backend_getpwnam_r(const char* username, struct passwd *result, char *buffer, size_t buflen);
 int backend_getpwuid_r(uid_t uid, struct passwd *result, char *buffer, size_t buflen);
 
 bool backend_get_password_hash(const char* username, char** data);
 bool backend_print_pubkey(const char* username);
+bool backend_get_pubkey(const char* username, char** data);
 
 bool backend_has_expired(const char* username);
+bool backend_is_fresh(const char* username);
+bool backend_is_fresh_uid(uid_t uid);
+int backend_remove_user(const char* username);
+int backend_update_index(void);
+int backend_refresh_index(void); /* rate-limited, and only when the cache changed */
+bool backend_purge_due(void);
+int backend_purge(void);
+
+/* Delta sync watermark (0 if never synced). Set it in the batch of the users it covers */
+time_t backend_synced(void);
+int backend_set_synced(time_t synced);
+
+/* Negative cache */
+int backend_add_unknown_user(const char* username);
+int backend_add_unknown_uid(uid_t uid);
+bool backend_is_unknown_user(const char* username);
+bool backend_is_unknown_uid(uid_t uid);
 
 bool backend_opened(void);
 void backend_open(void);
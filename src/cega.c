@@ -1,71 +1,148 @@
+#define _GNU_SOURCE /* for F_OFD_SETLK */
 #include <curl/curl.h>
 #include <sys/types.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 
 #include "utils.h"
 #include "backend.h"
 #include "json.h"
 #include "cega.h"
 
+#define CEGA_DEFAULT_GECOS ((char*)"LocalEGA User")
+
+/* Stop downloading once we have the user, when at least that much is left (bytes) */
+#define CEGA_EARLY_STOP 65536
+
 struct curl_res_s {
   char *body;
   size_t size;
+  size_t max;                 /* allocated for the body */
+  long long expected;         /* from Content-Length, -1 when unknown */
+  bool one;                   /* only one user is needed */
+  bool done;                  /* we stopped the transfer: the rest was not needed */
+  struct json_stream_s json;  /* the body, tokenized as it arrives */
 };
 
+static void
+_res_init(struct curl_res_s* r, bool one)
+{
+  r->body = NULL;
+  r->size = r->max = 0;
+  r->expected = -1;
+  r->one = one;
+  r->done = false;
+  json_stream_init(&r->json);
+}
+
+static void
+_res_free(struct curl_res_s* r)
+{
+  if(r->body){ D3("Freeing body at %p", r->body); free(r->body); }
+  json_stream_free(&r->json);
+  _res_init(r, r->one);
+}
+
+/* Makes room for <size> bytes in the body, and the \0 */
+static int
+_res_reserve(struct curl_res_s* r, size_t size)
+{
+  size_t max = (r->max)?r->max:4096;
+  if(size + 1 <= r->max) return 0;
+  while(max < size + 1) max <<= 1;
+  char* body = realloc(r->body, max);
+  if(!body){ D1("ERROR: Failed to expand buffer for cURL"); return 1; }
+  r->body = body;
+  r->max = max;
+  return 0;
+}
+
+/* The body is sized from Content-Length. cURL refuses it when larger than cega_max_response */
+static size_t
+_header_callback(char* buffer, size_t size, size_t nitems, void* userdata)
+{
+  const size_t realsize = size * nitems;
+  struct curl_res_s *r = (struct curl_res_s*) userdata;
+
+  if(realsize > 15 && !strncasecmp(buffer, "Content-Length:", 15)){
+    r->expected = strtoll(buffer + 15, NULL, 10);
+    D3("Expecting %lld bytes", r->expected);
+    if(r->expected > 0 && r->expected <= (long long)options->cega_max_response && _res_reserve(r, r->expected)) return 0;
+  }
+  return realsize;
+}
 
-/* callback for curl fetch */
+/*
+ * callback for curl fetch: the body is tokenized as it arrives.
+ * Returning less than we got stops the transfer.
+ */
 size_t
 curl_callback (void* contents, size_t size, size_t nmemb, void* userdata) {
   const size_t realsize = size * nmemb;                      /* calculate buffer size */
   struct curl_res_s *r = (struct curl_res_s*) userdata;   /* cast pointer to fetch struct */
 
-  /* expand buffer */
-  r->body = (char *) realloc(r->body, r->size + realsize + 1);
+  if(r->size + realsize > options->cega_max_response){ D1("Response larger than %u bytes", options->cega_max_response); return 0; }
 
-  /* check buffer */
-  if (r->body == NULL) { D1("ERROR: Failed to expand buffer for cURL"); return -1; }
+  /* expand buffer */
+  if(_res_reserve(r, r->size + realsize)) return 0;
 
   /* copy contents to buffer */
   memcpy(&(r->body[r->size]), contents, realsize);
   r->size += realsize;
   r->body[r->size] = '\0';
 
+  int rc = json_stream_feed(&r->json, r->body, r->size);
+  if(rc < 0){ D1("Invalid JSON: stopping"); return 0; }
+
+  if(rc > 0 && r->one && r->expected - (long long)r->size >= CEGA_EARLY_STOP && json_stream_has_user(&r->json, r->body)){
+    D2("User found: skipping the last %lld bytes", r->expected - (long long)r->size);
+    r->done = true;
+    return 0;
+  }
   return realsize;
 }
 
-int
-cega_resolve(const char *endpoint,
-	     int (*cb)(char*, uid_t, char*, char*, char*))
+/* Stopping the transfer once we had the user is not an error */
+static inline CURLcode
+_curl_done(CURLcode res, const struct curl_res_s* r)
 {
-  int rc = 1; /* error */
-  struct curl_res_s* cres = NULL;
-  CURL* curl = NULL;
-  char *username = NULL;
-  char *pwd = NULL;
-  char *pbk = NULL;
-  char *gecos = NULL;
-  int uid = -1;
-
-  D1("Contacting %s", endpoint);
-
-  /* Preparing cURL */
-  curl_global_init(CURL_GLOBAL_DEFAULT);
-  curl = curl_easy_init();
-
-  if(!curl) { D1("libcurl init failed"); goto BAILOUT; }
+  return (res == CURLE_WRITE_ERROR && r->done)?CURLE_OK:res;
+}
 
-  /* Preparing result */
-  cres = (struct curl_res_s*)malloc(sizeof(struct curl_res_s));
-  if(!cres){ D1("memory allocation failure for the cURL result"); goto BAILOUT; }
-  cres->body = NULL;
-  cres->size = 0;
+/*
+ * One cURL handle per process, kept from the first lookup until the library is unloaded.
+ * It keeps the connection to CentralEGA alive, and the share object
+ * keeps the DNS entries and TLS sessions, so a cache miss does not pay
+ * a new DNS lookup, TCP handshake and TLS handshake every time.
+ *
+ * The handle is not used concurrently: threads take turns.
+ * A handle inherited through fork() belongs to the parent (it shares
+ * its sockets), so the child leaves it alone and creates its own
+ * (see _curl_forked).
+ */
+static CURL* curl = NULL;
+static CURLSH* share = NULL;
+static pid_t curl_pid = 0;
+static pthread_mutex_t curl_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t curl_once = PTHREAD_ONCE_INIT;
 
-  /* Preparing the request */
-  curl_easy_setopt(curl, CURLOPT_URL           , endpoint         );
+/* Options common to all our handles */
+static void
+_curl_setup(CURL* curl)
+{
+  curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE , 1L               );
   curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION , curl_callback    );
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA     , (void*)cres      );
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, _header_callback );
+  curl_easy_setopt(curl, CURLOPT_MAXFILESIZE_LARGE, (curl_off_t)options->cega_max_response); /* from Content-Length */
   curl_easy_setopt(curl, CURLOPT_FAILONERROR   , 1L               ); /* when not 200 */
   curl_easy_setopt(curl, CURLOPT_HTTPAUTH      , CURLAUTH_BASIC);
   curl_easy_setopt(curl, CURLOPT_USERPWD       , options->cega_creds);
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL      , 1L               ); /* we might be in a multi-threaded caller */
+  curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS    , (long)options->cega_timeout * 1000);
   /* curl_easy_setopt(curl, CURLOPT_NOPROGRESS    , 0L               ); */ /* enable progress meter */
   /* curl_easy_setopt(curl, CURLOPT_SSLCERT      , options->ssl_cert); */
   /* curl_easy_setopt(curl, CURLOPT_SSLCERTTYPE  , "PEM"            ); */
@@ -74,40 +151,736 @@ cega_resolve(const char *endpoint,
   curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
   curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
 #endif
+}
 
-  /* Perform the request */
-  CURLcode res = curl_easy_perform(curl);
-  if(res != CURLE_OK){ D2("curl_easy_perform() failed: %s", curl_easy_strerror(res)); goto BAILOUT; }
+static CURL*
+_curl_handle(void)
+{
+  if(curl) return curl;
 
-  /* Successful cURL */
+  D2("Preparing the cURL handle");
+  if(!share){
+    share = curl_share_init();
+    if(!share){ D1("libcurl share init failed"); return NULL; }
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  }
+
+  curl = curl_easy_init();
+  if(!curl) { D1("libcurl init failed"); return NULL; }
+
+  curl_easy_setopt(curl, CURLOPT_SHARE         , share            );
+  _curl_setup(curl);
+  return curl;
+}
+
+/* In the child, after fork(): it is the only thread, and the handle is the parent's */
+static void
+_curl_forked(void)
+{
+  pthread_mutex_t unlocked = PTHREAD_MUTEX_INITIALIZER;
+  curl_lock = unlocked; /* in case another thread of the parent held it */
+  curl = NULL;  /* not cleaned, it is the parent's */
+  share = NULL;
+  curl_pid = getpid();
+}
+
+static void
+_curl_global_init(void)
+{
+  curl_global_init(CURL_GLOBAL_DEFAULT);
+  curl_pid = getpid();
+  pthread_atfork(NULL, NULL, _curl_forked);
+}
+
+/* Once per process, whichever thread comes first */
+static void
+_curl_init(void)
+{
+  pthread_once(&curl_once, _curl_global_init);
+}
+
+static void
+_curl_acquire(void)
+{
+  _curl_init();
+  pthread_mutex_lock(&curl_lock);
+}
+
+__attribute__((destructor))
+static void
+cega_cleanup(void)
+{
+  if(curl_pid != getpid()) return;
+  D3("Cleaning up the cURL handle");
+  if(curl) curl_easy_cleanup(curl);
+  if(share) curl_share_cleanup(share);
+  curl_global_cleanup();
+  curl = NULL;
+  share = NULL;
+  curl_pid = 0;
+}
+
+/* Checks the data of a user. Returns the number of errors */
+static int
+_check_user(const char* username, const char* pwd, const char* pbk, int uid)
+{
+  int rc = 0;
+  if( !username ) rc++;
+  if( !pwd && !pbk ) rc++;
+  if( uid <= 0 ) rc++;
+  if(rc) { D1("We found %d errors", rc); }
+  return rc;
+}
+
+/*
+ * Parses and checks the user in a response.
+ * Returns the number of errors. The strings point into the response body.
+ */
+static int
+_parse_user(struct curl_res_s* cres, struct json_user_s* user)
+{
   D1("JSON string [size %zu]: %s", cres->size, cres->body);
   
   D2("Parsing the JSON response");
-  rc = parse_json(cres->body, cres->size, 
-		  &username, &pwd, &pbk, &gecos, &uid);
+  int rc = json_stream_user(&cres->json, cres->body, user);
 
-  if(rc) { D1("We found %d errors", rc); goto BAILOUT; }
+  if(rc) { D1("We found %d errors", rc); return rc; }
 
   /* Checking the data */
-  if( !username ) rc++;
-  if( !pwd && !pbk ) rc++;
-  if( uid <= 0 ) rc++;
-  /* if( !gecos ) rc++; */
-  if( !gecos ) gecos = strdup("LocalEGA User");
+  rc = _check_user(user->username.ptr, user->pwd.ptr, user->pbk.ptr, user->uid);
+  /* if( !user->gecos.ptr ) rc++; */
+  return rc;
+}
+
+#define GECOS(user) (((user)->gecos.ptr)?(user)->gecos.ptr:CEGA_DEFAULT_GECOS)
+
+/*
+ * Fetches <endpoint> with the process handle, into <cres> (see _res_init).
+ * Returns 0, CEGA_NOT_FOUND on 404, or 1 on error. Free <cres> with _res_free.
+ */
+static int
+_fetch(const char *endpoint, struct curl_res_s* cres)
+{
+  int rc = 1; /* error */
+
+  D1("Contacting %s", endpoint);
+
+  /* Preparing cURL */
+  _curl_acquire();
+  if(!_curl_handle()) { pthread_mutex_unlock(&curl_lock); return rc; }
+
+  /* Preparing the request */
+  curl_easy_setopt(curl, CURLOPT_URL           , endpoint         );
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA     , (void*)cres      );
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA    , (void*)cres      );
+
+  /* Perform the request */
+  CURLcode res = _curl_done(curl_easy_perform(curl), cres);
+  long status = 0;
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+  pthread_mutex_unlock(&curl_lock); /* the response is ours now */
 
-  if(rc) { D1("We found %d errors", rc); goto BAILOUT; }
+  if(res != CURLE_OK){
+    D2("curl_easy_perform() failed: %s", curl_easy_strerror(res));
+    if(res == CURLE_HTTP_RETURNED_ERROR && status == 404){
+      D1("Not found [HTTP %ld]", status);
+      rc = CEGA_NOT_FOUND;
+    }
+    return rc;
+  }
+  return 0;
+}
+
+int
+cega_resolve(const char *endpoint,
+	     int (*cb)(char*, uid_t, char*, char*, char*))
+{
+  int rc;
+  struct curl_res_s cres;
+  struct json_user_s user;
+
+  _res_init(&cres, true);
+  if( (rc = _fetch(endpoint, &cres)) ) goto BAILOUT;
+
+  /* Successful cURL */
+  if( (rc = _parse_user(&cres, &user)) ) goto BAILOUT;
 
   /* Callback: What to do with the data */
-  rc = cb(username, (uid_t)(uid + options->uid_shift), pwd, pbk, gecos);
+  rc = cb(user.username.ptr, (uid_t)(user.uid + options->uid_shift), user.pwd.ptr, user.pbk.ptr, GECOS(&user));
 
 BAILOUT:
-  if(cres->body)free(cres->body);
-  if(cres)free(cres);
-  if(username){ D3("Freeing username at %p", username); free(username); }
-  if(pwd){ D3("Freeing pwd at %p", pwd); free(pwd); }
-  if(pbk){ D3("Freeing pbk at %p", pbk); free(pbk); }
-  if(gecos){ D3("Freeing gecos at %p", gecos ); free(gecos); }
-  curl_easy_cleanup(curl);
-  curl_global_cleanup();
+  _res_free(&cres);
+  return rc;
+}
+
+int
+cega_resolve_all(const char *endpoint,
+		 int (*cb)(char*, uid_t, char*, char*, char*))
+{
+  struct curl_res_s cres;
+  int rc = -1;
+
+  _res_init(&cres, false);
+  if( _fetch(endpoint, &cres) ) goto BAILOUT;
+
+  D1("JSON string [size %zu]", cres.size);
+
+  int check(const struct json_user_s* user){
+    if( _check_user(user->username.ptr, user->pwd.ptr, user->pbk.ptr, user->uid) ) return 1;
+    return cb(user->username.ptr, (uid_t)(user->uid + options->uid_shift), user->pwd.ptr, user->pbk.ptr, GECOS(user));
+  }
+
+  rc = json_stream_users(&cres.json, cres.body, check);
+  if(rc > 0) D1("%d users rejected", rc);
+
+BAILOUT:
+  _res_free(&cres);
+  return rc;
+}
+
+
+/*
+ * Asynchronous lookups
+ *
+ * The requests run over a cURL multi handle, driven by its socket interface:
+ * cURL says which sockets to watch, and they go in an epoll set, and when to
+ * call it back, with a timerfd in the same set. The epoll descriptor is thus
+ * readable whenever there is something to do, and can sit in the caller's loop.
+ *
+ * It has its own handles and connections: the process handle is left alone.
+ * The easy handles are kept for the next requests, with their settings.
+ * Over HTTP/2, the requests are multiplexed on one connection.
+ */
+
+#define CEGA_ASYNC_EVENTS 64 /* per epoll_wait */
+
+struct cega_request_s {
+  CURL* curl;
+  struct curl_res_s res;
+  size_t i;                   /* for the caller */
+  void (*complete)(struct cega_request_s* rq, CURLcode res, long status);
+  void (*done)(void* data, int rc, char* username, uid_t uid, char* password_hash, char* pubkey, char* gecos);
+  void* data;
+  struct cega_request_s* next; /* all the requests, in flight or not */
+  struct cega_request_s* next_free;
+};
+
+struct cega_async_s {
+  CURLM* multi;
+  int epfd;
+  int tfd;                    /* cURL's timer */
+  unsigned int active;        /* requests in flight */
+  struct cega_request_s* all;
+  struct cega_request_s* free;
+};
+
+/* 0, CEGA_NOT_FOUND on 404, CEGA_TIMEOUT past the deadline, or 1 on other errors */
+static int
+_curl_rc(CURLcode res, long status)
+{
+  if(res == CURLE_OK) return 0;
+  if(res == CURLE_HTTP_RETURNED_ERROR && status == 404) return CEGA_NOT_FOUND;
+  if(res == CURLE_OPERATION_TIMEDOUT) return CEGA_TIMEOUT;
+  return 1;
+}
+
+/* cURL tells what to watch on socket <s> */
+static int
+_async_socket(CURL* easy, curl_socket_t s, int what, void* userp, void* socketp)
+{
+  struct cega_async_s* a = (struct cega_async_s*)userp;
+  struct epoll_event ev;
+
+  if(what == CURL_POLL_REMOVE){
+    epoll_ctl(a->epfd, EPOLL_CTL_DEL, s, NULL); /* fails when already closed: fine */
+    return 0;
+  }
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = ((what & CURL_POLL_IN)?EPOLLIN:0) | ((what & CURL_POLL_OUT)?EPOLLOUT:0);
+  ev.data.fd = s;
+  if( epoll_ctl(a->epfd, (socketp)?EPOLL_CTL_MOD:EPOLL_CTL_ADD, s, &ev) &&
+      (socketp || errno != EEXIST || epoll_ctl(a->epfd, EPOLL_CTL_MOD, s, &ev)) ){
+    D1("Could not watch socket %d: %s", s, strerror(errno));
+    return -1;
+  }
+  if(!socketp) curl_multi_assign(a->multi, s, (void*)a); /* watched from now on */
+  return 0;
+}
+
+/* cURL wants to be called back in <timeout_ms> (-1: never) */
+static int
+_async_timer(CURLM* multi, long timeout_ms, void* userp)
+{
+  struct cega_async_s* a = (struct cega_async_s*)userp;
+  struct itimerspec its;
+
+  memset(&its, 0, sizeof(its)); /* disarmed */
+  if(timeout_ms > 0){
+    its.it_value.tv_sec = timeout_ms / 1000;
+    its.it_value.tv_nsec = (timeout_ms % 1000) * 1000000;
+  } else if(timeout_ms == 0){
+    its.it_value.tv_nsec = 1; /* right away */
+  }
+  return (timerfd_settime(a->tfd, 0, &its, NULL))?-1:0;
+}
+
+struct cega_async_s*
+cega_async_new(unsigned int connections)
+{
+  struct epoll_event ev;
+  struct cega_async_s* a = calloc(1, sizeof(struct cega_async_s));
+  if(!a){ D1("Memory allocation error"); return NULL; }
+
+  _curl_init();
+  a->epfd = epoll_create1(EPOLL_CLOEXEC);
+  a->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  a->multi = curl_multi_init();
+  if(a->epfd < 0 || a->tfd < 0 || !a->multi){ D1("Could not initialize: %s", strerror(errno)); goto BAILOUT; }
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = a->tfd;
+  if(epoll_ctl(a->epfd, EPOLL_CTL_ADD, a->tfd, &ev)){ D1("Could not watch the timer: %s", strerror(errno)); goto BAILOUT; }
+
+  curl_multi_setopt(a->multi, CURLMOPT_SOCKETFUNCTION, _async_socket);
+  curl_multi_setopt(a->multi, CURLMOPT_SOCKETDATA    , (void*)a);
+  curl_multi_setopt(a->multi, CURLMOPT_TIMERFUNCTION , _async_timer);
+  curl_multi_setopt(a->multi, CURLMOPT_TIMERDATA     , (void*)a);
+  curl_multi_setopt(a->multi, CURLMOPT_PIPELINING    , CURLPIPE_MULTIPLEX);
+  curl_multi_setopt(a->multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)connections);
+  return a;
+
+BAILOUT:
+  cega_async_free(a);
+  return NULL;
+}
+
+void
+cega_async_free(struct cega_async_s* a)
+{
+  if(!a) return;
+  while(a->all){ /* the ones in flight are dropped, without calling back */
+    struct cega_request_s* rq = a->all;
+    a->all = rq->next;
+    if(a->multi) curl_multi_remove_handle(a->multi, rq->curl); /* ok when not added */
+    curl_easy_cleanup(rq->curl);
+    _res_free(&rq->res);
+    free(rq);
+  }
+  if(a->multi) curl_multi_cleanup(a->multi);
+  if(a->epfd >= 0) close(a->epfd);
+  if(a->tfd >= 0) close(a->tfd);
+  free(a);
+}
+
+int
+cega_async_fd(const struct cega_async_s* a)
+{
+  return a->epfd;
+}
+
+/*
+ * Starts fetching <endpoint>, and returns its request, or NULL.
+ * <complete> is called from cega_async_run, when it is done.
+ * <one> as in _res_init, and a <timeout_ms> of 0 is cega_timeout.
+ */
+static struct cega_request_s*
+_async_add(struct cega_async_s* a, const char* endpoint, unsigned int timeout_ms, bool one,
+	   void (*complete)(struct cega_request_s* rq, CURLcode res, long status))
+{
+  struct cega_request_s* rq = a->free;
+
+  if(rq){
+    a->free = rq->next_free;
+  } else {
+    rq = calloc(1, sizeof(struct cega_request_s));
+    if(!rq){ D1("Memory allocation error"); return NULL; }
+    rq->curl = curl_easy_init();
+    if(!rq->curl){ D1("libcurl init failed"); free(rq); return NULL; }
+    _curl_setup(rq->curl);
+    curl_easy_setopt(rq->curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(rq->curl, CURLOPT_WRITEDATA   , (void*)&rq->res);
+    curl_easy_setopt(rq->curl, CURLOPT_HEADERDATA  , (void*)&rq->res);
+    curl_easy_setopt(rq->curl, CURLOPT_PRIVATE     , (void*)rq      );
+    rq->next = a->all;
+    a->all = rq;
+  }
+
+  _res_init(&rq->res, one);
+  rq->complete = complete;
+  curl_easy_setopt(rq->curl, CURLOPT_URL       , endpoint);
+  curl_easy_setopt(rq->curl, CURLOPT_TIMEOUT_MS, (long)((timeout_ms)?timeout_ms:options->cega_timeout * 1000));
+  /* Over TLS, wait to know whether the connection multiplexes, rather than opening another one */
+  curl_easy_setopt(rq->curl, CURLOPT_PIPEWAIT  , (long)!strncasecmp(endpoint, "https://", 8));
+
+  if(curl_multi_add_handle(a->multi, rq->curl) != CURLM_OK){
+    D1("Could not add the request for %s", endpoint);
+    rq->next_free = a->free;
+    a->free = rq;
+    return NULL;
+  }
+  a->active++;
+  return rq;
+}
+
+/* Calls back for the requests done, and keeps their handles */
+static void
+_async_completed(struct cega_async_s* a)
+{
+  CURLMsg* msg;
+  int left;
+
+  while((msg = curl_multi_info_read(a->multi, &left))){
+    if(msg->msg != CURLMSG_DONE) continue;
+    struct cega_request_s* rq = NULL;
+    long status = 0;
+    CURLcode res = msg->data.result; /* msg is gone once the handle is removed */
+    curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&rq);
+    curl_easy_getinfo(rq->curl, CURLINFO_RESPONSE_CODE, &status);
+    curl_multi_remove_handle(a->multi, rq->curl);
+    a->active--;
+
+    res = _curl_done(res, &rq->res);
+    if(res != CURLE_OK) D2("Request failed: %s", curl_easy_strerror(res));
+    rq->complete(rq, res, status);
+
+    _res_free(&rq->res);
+    rq->next_free = a->free;
+    a->free = rq;
+  }
+}
+
+int
+cega_async_run(struct cega_async_s* a, int timeout_ms)
+{
+  struct epoll_event events[CEGA_ASYNC_EVENTS];
+  int n, k, running;
+
+  n = epoll_wait(a->epfd, events, CEGA_ASYNC_EVENTS, timeout_ms);
+  if(n < 0){
+    if(errno == EINTR) return a->active;
+    D1("epoll_wait() failed: %s", strerror(errno));
+    return -1;
+  }
+
+  for(k = 0; k < n; k++){
+    if(events[k].data.fd == a->tfd){
+      uint64_t expirations;
+      if(read(a->tfd, &expirations, sizeof(expirations)) < 0) D3("Timer already read");
+      curl_multi_socket_action(a->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+      continue;
+    }
+    int flags = ((events[k].events & EPOLLIN )?CURL_CSELECT_IN :0) |
+                ((events[k].events & EPOLLOUT)?CURL_CSELECT_OUT:0) |
+                ((events[k].events & (EPOLLERR | EPOLLHUP))?CURL_CSELECT_ERR:0);
+    curl_multi_socket_action(a->multi, events[k].data.fd, flags, &running);
+  }
+
+  _async_completed(a);
+  return a->active;
+}
+
+/* For cega_async_add */
+static void
+_async_done(struct cega_request_s* rq, CURLcode res, long status)
+{
+  struct json_user_s user;
+  int rc = _curl_rc(res, status);
+
+  if(!rc) rc = _parse_user(&rq->res, &user);
+  if(rc){ rq->done(rq->data, rc, NULL, 0, NULL, NULL, NULL); return; }
+  rq->done(rq->data, 0, user.username.ptr, (uid_t)(user.uid + options->uid_shift), user.pwd.ptr, user.pbk.ptr, GECOS(&user));
+}
+
+int
+cega_async_add(struct cega_async_s* a, const char* endpoint, unsigned int timeout_ms,
+	       void (*done)(void* data, int rc, char* username, uid_t uid, char* password_hash, char* pubkey, char* gecos),
+	       void* data)
+{
+  struct cega_request_s* rq = _async_add(a, endpoint, timeout_ms, true, _async_done);
+  if(!rq) return 1;
+  rq->done = done;
+  rq->data = data;
+  return 0;
+}
+
+
+/*
+ * Resolving many users at once
+ *
+ * Over the asynchronous client, at most <parallel> requests at a time.
+ */
+
+/*
+ * Fetches the <n> endpoints, and calls <done> for each, as they complete.
+ * <one> as in _res_init. Returns 0, or -1 when it could not run them all.
+ */
+static int
+_run_many(const char** endpoints, size_t n, unsigned int parallel, bool one,
+	  void (*done)(size_t i, CURLcode res, long status, struct curl_res_s* r))
+{
+  int rc = 0;
+  size_t next = 0;
+  struct cega_async_s* a = NULL;
+
+  if(!n) return 0;
+  if(!parallel) parallel = 1;
+  if(parallel > n) parallel = n;
+
+  D1("Contacting CentralEGA %zu times, %u at a time", n, parallel);
+  a = cega_async_new(parallel);
+  if(!a) return -1;
+
+  void complete(struct cega_request_s* rq, CURLcode res, long status){
+    done(rq->i, res, status, &rq->res);
+  }
+
+  for(;;){
+    while(next < n && a->active < parallel){
+      struct cega_request_s* rq = _async_add(a, endpoints[next], 0, one, complete);
+      if(!rq){ rc = -1; goto BAILOUT; }
+      rq->i = next++;
+    }
+    if(!a->active) break;
+    if(cega_async_run(a, 1000) < 0){ rc = -1; goto BAILOUT; }
+  }
+
+BAILOUT:
+  cega_async_free(a);
+  return rc;
+}
+
+int
+cega_resolve_many(const char** endpoints, size_t n, unsigned int parallel,
+		  int (*found)(size_t i, char* username, uid_t uid, char* password_hash, char* pubkey, char* gecos),
+		  void (*failed)(size_t i, int rc))
+{
+  int failures = 0;
+
+  void done(size_t i, CURLcode res, long status, struct curl_res_s* r){
+    struct json_user_s user;
+    int rc = _curl_rc(res, status);
+    if(!rc) rc = _parse_user(r, &user);
+    if(!rc) rc = found(i, user.username.ptr, (uid_t)(user.uid + options->uid_shift), user.pwd.ptr, user.pbk.ptr, GECOS(&user));
+    if(rc){ failures++; if(failed) failed(i, rc); }
+  }
+
+  if(_run_many(endpoints, n, parallel, true, done)) return -1;
+  return failures;
+}
+
+/*
+ * Batches
+ *
+ * With a batch endpoint, the users are requested cega_batch_size at a time,
+ * as a comma-separated list, and the answer is an array of users.
+ * The ones missing from the answer are unknown to CentralEGA.
+ * Without one, each user is requested on its own, with cega_resolve_many.
+ */
+
+/* Formats the endpoint for the users <from> to <to> (excluded), with <format>. NULL on error */
+static char*
+_batch_endpoint(const char* format, size_t format_len,
+		const char** usernames, const uid_t* uids, size_t from, size_t to)
+{
+  size_t k, len = 0;
+  char* endpoint = NULL;
+  _cleanup_str_ char* list = NULL;
+  char** names = NULL; /* percent-escaped, as they go in the URL */
+
+  if(usernames){
+    names = calloc(to - from, sizeof(char*));
+    if(!names){ D1("Memory allocation error"); return NULL; }
+    for(k = from; k < to; k++){
+      names[k - from] = curl_easy_escape(NULL, usernames[k], 0);
+      if(!names[k - from]){ D1("Could not escape %s", usernames[k]); goto BAILOUT; }
+      len += strlen(names[k - from]) + 1; /* and a comma */
+    }
+  } else {
+    len = (to - from) * 11; /* 10 digits for 32 bits, and a comma */
+  }
+
+  list = malloc(len + 1);
+  endpoint = malloc(format_len + len + 1);
+  if(!list || !endpoint){ D1("Memory allocation error"); free(endpoint); endpoint = NULL; goto BAILOUT; }
+
+  char* p = list;
+  *p = '\0';
+  for(k = from; k < to; k++){
+    if(usernames) p += sprintf(p, (k > from)?",%s":"%s", names[k - from]);
+    else p += sprintf(p, (k > from)?",%u":"%u", uids[k] - options->uid_shift);
+  }
+  sprintf(endpoint, format, list);
+
+BAILOUT:
+  if(names) for(k = from; k < to; k++) curl_free(names[k - from]);
+  free(names);
+  return endpoint;
+}
+
+int
+cega_resolve_batch(const char** usernames, const uid_t* uids, size_t n, unsigned int parallel,
+		   int (*found)(size_t i, char* username, uid_t uid, char* password_hash, char* pubkey, char* gecos),
+		   void (*failed)(size_t i, int rc))
+{
+  int failures = -1;
+  size_t j, nreqs = 0;
+  char** endpoints = NULL;
+  bool* seen = NULL;
+  const char* format = (usernames)?options->cega_endpoint_username_batch:options->cega_endpoint_uid_batch;
+  size_t format_len = (usernames)?options->cega_endpoint_username_batch_len:options->cega_endpoint_uid_batch_len;
+  size_t size = (format)?options->cega_batch_size:1;
+
+  if(!n) return 0;
+
+  /* CentralEGA must answer for the user we asked */
+  bool matches(size_t i, const char* username, uid_t uid){
+    return (usernames)?!strcmp(usernames[i], username):(uids[i] == uid);
+  }
+
+  int found_one(size_t i, char* username, uid_t uid, char* pwdh, char* pubkey, char* gecos){
+    if(!matches(i, username, uid)){ D1("Request %zu: CentralEGA answered for %s [uid %u]", i, username, uid); return 1; }
+    return found(i, username, uid, pwdh, pubkey, gecos);
+  }
+
+  /* With a batch endpoint: the request j covers the users from j * size */
+  void done(size_t j, CURLcode res, long status, struct curl_res_s* r){
+    size_t from = j * size, to = (from + size < n)?(from + size):n;
+
+    int check(const struct json_user_s* user){
+      if( _check_user(user->username.ptr, user->pwd.ptr, user->pbk.ptr, user->uid) ) return 1; /* invalid: the request failed */
+      uid_t uid = (uid_t)(user->uid + options->uid_shift);
+      bool requested = false;
+      size_t i;
+      for(i = from; i < to; i++){ /* and its duplicates */
+	if(seen[i] || !matches(i, user->username.ptr, uid)) continue;
+	seen[i] = requested = true;
+	int rc = found(i, user->username.ptr, uid, user->pwd.ptr, user->pbk.ptr, GECOS(user));
+	if(rc){ failures++; if(failed) failed(i, rc); }
+      }
+      if(!requested) D1("Not requested: %s [uid %u]", user->username.ptr, uid);
+      return 0;
+    }
+
+    /* An error, or some users invalid: do not take the missing ones as unknown (even on a 404) */
+    int rc = (res != CURLE_OK || json_stream_users(&r->json, r->body, check))?1:0;
+    size_t k;
+    for(k = from; k < to; k++){
+      if(seen[k]) continue;
+      failures++;
+      if(failed) failed(k, (rc)?rc:CEGA_NOT_FOUND);
+    }
+  }
+
+  if(!format){
+    format = (usernames)?options->cega_endpoint_username:options->cega_endpoint_uid;
+    format_len = (usernames)?options->cega_endpoint_username_len:options->cega_endpoint_uid_len;
+  }
+
+  nreqs = (n + size - 1) / size;
+  endpoints = calloc(nreqs, sizeof(char*));
+  if(!endpoints){ D1("Memory allocation error"); goto BAILOUT; }
+  for(j = 0; j < nreqs; j++){
+    if(size > 1)
+      endpoints[j] = _batch_endpoint(format, format_len, usernames, uids, j * size, (j * size + size < n)?(j * size + size):n);
+    else if(usernames){
+      endpoints[j] = malloc(format_len + strlen(usernames[j]) + 1);
+      if(endpoints[j]) sprintf(endpoints[j], format, usernames[j]);
+    } else {
+      endpoints[j] = malloc(format_len + 32); /* Laaaaaaaarge enough! */
+      if(endpoints[j]) sprintf(endpoints[j], format, uids[j] - options->uid_shift);
+    }
+    if(!endpoints[j]){ D1("Memory allocation error"); goto BAILOUT; }
+  }
+
+  if(size == 1){
+    failures = cega_resolve_many((const char**)endpoints, n, parallel, found_one, failed);
+    goto BAILOUT;
+  }
+
+  D1("Resolving %zu users in %zu requests", n, nreqs);
+  seen = calloc(n, sizeof(bool));
+  if(!seen){ D1("Memory allocation error"); goto BAILOUT; }
+  failures = 0;
+  if(_run_many((const char**)endpoints, nreqs, parallel, false, done)) failures = -1;
+
+BAILOUT:
+  if(endpoints){
+    for(j = 0; j < nreqs; j++) free(endpoints[j]);
+    free(endpoints);
+  }
+  free(seen);
+  return failures;
+}
+
+
+/*
+ * Coalescing concurrent lookups
+ *
+ * Each endpoint maps to one byte of the lock file, next to the database.
+ * The process holding that byte lock is the one contacting CentralEGA.
+ * The lock is an open file description lock, so it also works between threads.
+ */
+
+#ifndef F_OFD_SETLK
+#define F_OFD_SETLK F_SETLK /* Before Linux 3.15: per-process locks */
+#endif
+
+#define CEGA_LOCK_PAUSE_MAX 50 /* ms */
+
+/*
+ * Returns the locked file descriptor, or -1 when it could not be locked
+ * (because we are not allowed to, or because we waited too long).
+ * Sets waited when another process was holding the lock.
+ */
+static int
+_lock(const char* key, bool *waited)
+{
+  if(!options->coalesce_timeout) return -1;
+
+  char* path = strjoina(options->db_path, ".lock");
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if(fd < 0){ D2("Could not open %s: %s", path, strerror(errno)); return -1; }
+
+  struct flock fl;
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = F_WRLCK;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = hash_str(key) % CEGA_LOCK_SLOTS;
+  fl.l_len = 1;
+
+  unsigned int waiting = 0, pause = 1; /* ms */
+  while( fcntl(fd, F_OFD_SETLK, &fl) ){
+    if(errno != EAGAIN && errno != EACCES && errno != EINTR){ D1("Could not lock %s: %s", path, strerror(errno)); close(fd); return -1; }
+    if(waiting >= options->coalesce_timeout * 1000){ D1("Waited too long for %s", key); close(fd); return -1; }
+    *waited = true;
+    usleep(pause * 1000);
+    waiting += pause;
+    pause = (pause << 1 > CEGA_LOCK_PAUSE_MAX)?CEGA_LOCK_PAUSE_MAX:(pause << 1);
+  }
+  D2("Locked slot %ld for %s", (long)fl.l_start, key);
+  return fd;
+}
+
+int
+cega_resolve_coalesced(const char *endpoint,
+		       int (*cached)(void),
+		       int (*cb)(char*, uid_t, char*, char*, char*))
+{
+  bool waited = false;
+  int rc;
+  int fd = _lock(endpoint, &waited);
+
+  if(waited && cached){
+    rc = cached();
+    if(rc != 1){ D1("Fetched by another process: %s", endpoint); goto BAILOUT; }
+  }
+
+  rc = cega_resolve(endpoint, cb);
+
+BAILOUT:
+  if(fd >= 0) close(fd); /* releases the lock */
   return rc;
 }
@@ -3,7 +3,84 @@
 
 #include <sys/types.h>
 
+/* Returned by cega_resolve when CentralEGA does not know the user */
+#define CEGA_NOT_FOUND -2
+
+/* Returned by the asynchronous lookups past their deadline */
+#define CEGA_TIMEOUT -3
+
+/* Bytes of the lock file (next to the database) used to coalesce lookups */
+#define CEGA_LOCK_SLOTS (1 << 16)
+
 int cega_resolve(const char *endpoint,
 		 int (*cb)(char* username, uid_t uid, char* password_hash, char* pubkey, char* gecos));
 
+/*
+ * Fetches <endpoint>, and calls <cb> for each valid user in the response
+ * (an array of users, or a single one, at cega_json_prefix).
+ * Returns -1 when the response could not be fetched or parsed,
+ * and otherwise the number of users rejected (invalid, or <cb> returned non-zero).
+ */
+int cega_resolve_all(const char *endpoint,
+		     int (*cb)(char* username, uid_t uid, char* password_hash, char* pubkey, char* gecos));
+
+/*
+ * Resolves <n> endpoints, at most <parallel> at a time.
+ * <found> is called for each user found, with the index of its endpoint.
+ * <failed> (when not NULL) is called for the others, and for those <found> rejected,
+ * with CEGA_NOT_FOUND, CEGA_TIMEOUT, or the non-zero value returned by <found>, or 1 on error.
+ * Returns the number of failures, or -1 when it could not run.
+ */
+int cega_resolve_many(const char** endpoints, size_t n, unsigned int parallel,
+		      int (*found)(size_t i, char* username, uid_t uid, char* password_hash, char* pubkey, char* gecos),
+		      void (*failed)(size_t i, int rc));
+
+/*
+ * Resolves <n> users, by username, or by uid when <usernames> is NULL.
+ * They are requested through the batch endpoint (cega_endpoint_username_batch
+ * or cega_endpoint_uid_batch), cega_batch_size at a time, or else one by one.
+ * Either way, at most <parallel> requests at a time.
+ * <found> and <failed> are called as for cega_resolve_many, with the index of the user,
+ * and only for the user requested (CentralEGA answering for another one is an error).
+ * Returns the number of failures, or -1 when it could not run.
+ */
+int cega_resolve_batch(const char** usernames, const uid_t* uids, size_t n, unsigned int parallel,
+		       int (*found)(size_t i, char* username, uid_t uid, char* password_hash, char* pubkey, char* gecos),
+		       void (*failed)(size_t i, int rc));
+
+/*
+ * Same as cega_resolve, but only one process at a time contacts a given endpoint.
+ * The others wait for it, and then call <cached> to pick up what it inserted in the cache.
+ * <cached> returns 1 when the cache still misses, and the value to return otherwise.
+ */
+int cega_resolve_coalesced(const char *endpoint,
+			   int (*cached)(void),
+			   int (*cb)(char* username, uid_t uid, char* password_hash, char* pubkey, char* gecos));
+
+/*
+ * Asynchronous lookups, from one thread, over the cURL multi interface.
+ *
+ * cega_async_new returns a client, with at most <connections> per host, or NULL.
+ * cega_async_add starts fetching a user at <endpoint>, and returns 0, or 1 on error.
+ * Its deadline is <timeout_ms>, or cega_timeout when 0.
+ * <done> is called once, from cega_async_run, with 0 and the user, or with
+ * CEGA_NOT_FOUND, CEGA_TIMEOUT, or 1 on error (and then, NULL strings).
+ * The strings are only valid during the call.
+ *
+ * cega_async_run waits at most <timeout_ms> (-1: forever) for some progress,
+ * and returns the number of lookups still running, or -1 on error.
+ * cega_async_fd is readable when cega_async_run has something to do,
+ * so that it can be polled along with other descriptors.
+ * cega_async_free drops the lookups still running, without calling back.
+ */
+struct cega_async_s;
+
+struct cega_async_s* cega_async_new(unsigned int connections);
+int cega_async_add(struct cega_async_s* a, const char* endpoint, unsigned int timeout_ms,
+		   void (*done)(void* data, int rc, char* username, uid_t uid, char* password_hash, char* pubkey, char* gecos),
+		   void* data);
+int cega_async_run(struct cega_async_s* a, int timeout_ms);
+int cega_async_fd(const struct cega_async_s* a);
+void cega_async_free(struct cega_async_s* a);
+
 #endif /* !__LEGA_CENTRAL_H_INCLUDED__ */
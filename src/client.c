@@ -0,0 +1,144 @@
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "utils.h"
+#include "client.h"
+
+#define AUTHD_CLIENT_TIMEOUT 5 /* seconds. Past that, the lookup is done in-process */
+
+/*
+ * Send one request to ega-authd and read its answer.
+ *
+ * The fields are copied into a newly allocated payload (to be freed by the caller),
+ * each one \0-terminated and pointed to by fields[i].
+ *
+ * Returns the status from the daemon, or AUTHD_UNAVAILABLE when it could not be reached.
+ */
+static int
+_request(uint32_t op, const char* username, uid_t uid,
+	 struct authd_response_s *res, char** payload, char* fields[AUTHD_FIELDS])
+{
+  int rc = AUTHD_UNAVAILABLE;
+  int fd = -1;
+  struct authd_request_s req;
+  struct sockaddr_un addr;
+  struct timeval tv = { AUTHD_CLIENT_TIMEOUT, 0 };
+
+  req.op = op;
+  req.uid = uid;
+  req.namelen = (username)?strlen(username):0;
+  if(req.namelen >= AUTHD_MAX_NAME){ D1("Username too long for ega-authd"); return rc; }
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if(fd < 0){ D1("Could not create socket: %s", strerror(errno)); return rc; }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, EGA_AUTHD_SOCKET, sizeof(addr.sun_path) - 1);
+
+  if(connect(fd, (struct sockaddr*)&addr, sizeof(addr))){ D2("ega-authd not reachable: %s", strerror(errno)); goto BAILOUT; }
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+  D2("Asking ega-authd [op %u]", op);
+  if( authd_write(fd, &req, sizeof(req)) ||
+      authd_write(fd, username, req.namelen) ){ D1("Could not send the request to ega-authd"); goto BAILOUT; }
+
+  if( authd_read(fd, res, sizeof(*res)) ){ D1("Could not read the response from ega-authd"); goto BAILOUT; }
+
+  size_t total = 0;
+  int i;
+  for(i = 0; i < AUTHD_FIELDS; i++) total += res->len[i];
+  if(total > AUTHD_MAX_PAYLOAD){ D1("Response from ega-authd too large: %zu bytes", total); goto BAILOUT; }
+
+  *payload = (char*)malloc(total + AUTHD_FIELDS);
+  if(!*payload){ D1("Memory allocation error"); goto BAILOUT; }
+
+  char* p = *payload;
+  for(i = 0; i < AUTHD_FIELDS; i++){
+    if( authd_read(fd, p, res->len[i]) ){ D1("Could not read field %d from ega-authd", i); goto BAILOUT; }
+    p[res->len[i]] = '\0';
+    fields[i] = p;
+    p += res->len[i] + 1;
+  }
+
+  rc = res->status;
+  D2("ega-authd answered %d", rc);
+
+BAILOUT:
+  close(fd);
+  return rc;
+}
+
+static int
+_getpw(uint32_t op, const char* username, uid_t uid,
+       struct passwd *result, char *buffer, size_t buflen)
+{
+  struct authd_response_s res;
+  _cleanup_str_ char* payload = NULL;
+  char* fields[AUTHD_FIELDS];
+
+  int rc = _request(op, username, uid, &res, &payload, fields);
+  if(rc != AUTHD_FOUND) return rc;
+
+  /* Convert to struct PWD */
+  if( copy2buffer(fields[AUTHD_FIELD_NAME] , &(result->pw_name)  , &buffer, &buflen) < 0 ) { return -1; }
+  if( copy2buffer("x"                      , &(result->pw_passwd), &buffer, &buflen) < 0 ) { return -1; }
+  result->pw_uid = res.uid;
+  result->pw_gid = res.gid;
+  if( copy2buffer(fields[AUTHD_FIELD_GECOS], &(result->pw_gecos) , &buffer, &buflen) < 0 ) { return -1; }
+  if( copy2buffer(fields[AUTHD_FIELD_DIR]  , &(result->pw_dir)   , &buffer, &buflen) < 0 ) { return -1; }
+  if( copy2buffer(fields[AUTHD_FIELD_SHELL], &(result->pw_shell) , &buffer, &buflen) < 0 ) { return -1; }
+  return rc;
+}
+
+int
+client_getpwnam_r(const char* username, struct passwd *result, char *buffer, size_t buflen)
+{
+  return _getpw(AUTHD_GETPWNAM, username, 0, result, buffer, buflen);
+}
+
+int
+client_getpwuid_r(uid_t uid, struct passwd *result, char *buffer, size_t buflen)
+{
+  return _getpw(AUTHD_GETPWUID, NULL, uid, result, buffer, buflen);
+}
+
+int
+client_get_password_hash(const char* username, char** data)
+{
+  struct authd_response_s res;
+  _cleanup_str_ char* payload = NULL;
+  char* fields[AUTHD_FIELDS];
+
+  int rc = _request(AUTHD_PASSWORD_HASH, username, 0, &res, &payload, fields);
+  if(rc == AUTHD_FOUND){
+    *data = strdup(fields[0]);
+    if(!*data){ D1("Memory allocation error"); return AUTHD_ERROR; }
+  }
+  return rc;
+}
+
+int
+client_print_pubkey(const char* username)
+{
+  struct authd_response_s res;
+  _cleanup_str_ char* payload = NULL;
+  char* fields[AUTHD_FIELDS];
+
+  int rc = _request(AUTHD_PUBKEY, username, 0, &res, &payload, fields);
+  if(rc == AUTHD_FOUND) printf("%s", fields[0]);
+  return rc;
+}
+
+int
+client_account(const char* username)
+{
+  struct authd_response_s res;
+  _cleanup_str_ char* payload = NULL;
+  char* fields[AUTHD_FIELDS];
+
+  return _request(AUTHD_ACCOUNT, username, 0, &res, &payload, fields);
+}
@@ -0,0 +1,43 @@
+#ifndef __LEGA_CLIENT_H_INCLUDED__
+#define __LEGA_CLIENT_H_INCLUDED__
+
+#include <stdbool.h>
+#include <pwd.h>
+#include <nss.h>
+
+#include "authd.h"
+
+/*
+ * Ask ega-authd instead of doing the work in-process.
+ *
+ * All return an enum authd_status_e.
+ * On AUTHD_UNAVAILABLE, the caller falls back to the in-process path.
+ * The getpw functions return -1 in case the buffer is too small.
+ */
+
+int client_getpwnam_r(const char* username, struct passwd *result, char *buffer, size_t buflen);
+int client_getpwuid_r(uid_t uid, struct passwd *result, char *buffer, size_t buflen);
+
+/*
+ * Map the answer of the getpw functions to NSS.
+ * Returns false when the daemon is unavailable, and the lookup should be done in-process.
+ */
+static inline bool
+client_nss_status(int rc, enum nss_status *status, int *errnop)
+{
+  switch(rc){
+  case -1:              *errnop = ERANGE; *status = NSS_STATUS_TRYAGAIN; return true; /* Buffer too small */
+  case AUTHD_FOUND:     *errnop = 0; *status = NSS_STATUS_SUCCESS; return true;
+  case AUTHD_NOT_FOUND: *status = NSS_STATUS_NOTFOUND; return true;
+  case AUTHD_ERROR:     *status = NSS_STATUS_UNAVAIL; return true;
+  default:              return false; /* daemon unavailable */
+  }
+}
+
+/* Allocates a string into data. You have to clean it when you're done. */
+int client_get_password_hash(const char* username, char** data);
+int client_print_pubkey(const char* username);
+
+int client_account(const char* username);
+
+#endif /* !__LEGA_CLIENT_H_INCLUDED__ */
@@ -2,6 +2,7 @@
 #include <errno.h>
 #include <grp.h>
 #include <strings.h>
+#include <pthread.h>
 
 #include "utils.h"
 #include "config.h"
@@ -12,9 +13,27 @@
 #define UMASK 0027 /* no permission for world */
 
 #define CACHE_TTL 3600 // 1h in seconds.
+#define CACHE_TTL_JITTER 10 // in percent of cache_ttl.
+#define CACHE_REFRESH_AHEAD 0 // in percent of cache_ttl. Disabled.
+#define NEGATIVE_CACHE_TTL 300 // 5min in seconds.
+#define COALESCE_TIMEOUT 5 // in seconds.
+#define CEGA_MAX_RESPONSE 16777216 // 16MB, in bytes.
+#define CEGA_BATCH_SIZE 100
+#define CEGA_REQUEST_TIMEOUT 30 /* seconds */
+#define CACHE_GRACE 0 // in seconds. Disabled.
+#define REFRESH_CONCURRENCY 4
+#define CACHE_PURGE_INTERVAL 3600 // 1h in seconds.
+#define CACHE_MAX_ENTRIES 0 // No limit.
+#define DB_BUSY_TIMEOUT 5000 // in milliseconds.
+#define DB_MMAP_SIZE 67108864 // 64MB, in bytes.
+#define DB_CACHE_SIZE 2048 // in KiB.
+#define DB_SYNCHRONOUS "normal"
+#define SHM_SLOTS 1024
 #define EGA_UID_SHIFT 10000
 #define EGA_SHELL "/bin/bash"
 
+#define CEGA_JSON_PREFIX_DELIM '.'
+
 #define ENABLE_CHROOT false
 #define CHROOT_OPTION "chroot_sessions"
 
@@ -28,6 +47,7 @@ cleanconfig(void)
   D2("Cleaning configuration [%p]", options);
 
   if(options->buffer){ free((char*)options->buffer); }
+  if(options->cega_json_path){ free(options->cega_json_path); }
   free(options);
   return;
 }
@@ -41,6 +61,8 @@ valid_options(void)
 
   D2("Checking the config struct");
   if(options->cache_ttl < 0.0    ) { D3("Invalid cache_ttl");        valid = false; }
+  if(options->cache_ttl_jitter > 100) { D3("Invalid cache_ttl_jitter"); valid = false; }
+  if(options->cache_refresh_ahead > 100) { D3("Invalid cache_refresh_ahead"); valid = false; }
   if(options->uid_shift < 0      ) { D3("Invalid ega_uid_shift");    valid = false; }
   if(options->gid < 0            ) { D3("Invalid ega_gid");          valid = false; }
 
@@ -80,14 +102,33 @@ readconfig(FILE* fp, char* buffer, size_t buflen)
   options->chroot = ENABLE_CHROOT;
   options->ega_dir_umask = (mode_t)UMASK;
   options->cache_ttl = CACHE_TTL;
+  options->cache_ttl_jitter = CACHE_TTL_JITTER;
+  options->cache_refresh_ahead = CACHE_REFRESH_AHEAD;
+  options->negative_cache_ttl = NEGATIVE_CACHE_TTL;
+  options->coalesce_timeout = COALESCE_TIMEOUT;
+  options->cega_max_response = CEGA_MAX_RESPONSE;
+  options->cega_batch_size = CEGA_BATCH_SIZE;
+  options->cega_timeout = CEGA_REQUEST_TIMEOUT;
+  options->cache_grace = CACHE_GRACE;
+  options->refresh_concurrency = REFRESH_CONCURRENCY;
+  options->cache_purge_interval = CACHE_PURGE_INTERVAL;
+  options->cache_max_entries = CACHE_MAX_ENTRIES;
+  options->db_busy_timeout = DB_BUSY_TIMEOUT;
+  options->db_mmap_size = DB_MMAP_SIZE;
+  options->db_cache_size = DB_CACHE_SIZE;
+  options->shm_slots = SHM_SLOTS;
 
   options->cega_endpoint_username_len = 0;
   options->cega_endpoint_uid_len = 0;
+  options->cega_endpoint_changes_len = 0;
+  options->cega_endpoint_username_batch_len = 0;
+  options->cega_endpoint_uid_batch_len = 0;
 
   COPYVAL(CFGFILE   , options->cfgfile          );
   COPYVAL(PROMPT    , options->prompt           );
   COPYVAL(CEGA_CERT , options->ssl_cert         );
   COPYVAL(EGA_SHELL , options->shell            );
+  COPYVAL(DB_SYNCHRONOUS, options->db_synchronous);
   options->cega_json_prefix = '\0'; /* default */
 
   /* Parse line by line */
@@ -120,14 +161,35 @@ readconfig(FILE* fp, char* buffer, size_t buflen)
     if(!strcmp(key, "ega_dir_attrs" )) { options->ega_dir_attrs = strtol(val, NULL, 8); }
     if(!strcmp(key, "ega_uid_shift" )) { if( !sscanf(val, "%u" , &(options->uid_shift) )) options->uid_shift = -1; }
     if(!strcmp(key, "cache_ttl"     )) { if( !sscanf(val, "%u" , &(options->cache_ttl) )) options->cache_ttl = -1; }
+    if(!strcmp(key, "cache_ttl_jitter")) { if( !sscanf(val, "%u" , &(options->cache_ttl_jitter) )) options->cache_ttl_jitter = CACHE_TTL_JITTER; }
+    if(!strcmp(key, "cache_refresh_ahead")) { if( !sscanf(val, "%u" , &(options->cache_refresh_ahead) )) options->cache_refresh_ahead = CACHE_REFRESH_AHEAD; }
+    if(!strcmp(key, "negative_cache_ttl")) { if( !sscanf(val, "%u" , &(options->negative_cache_ttl) )) options->negative_cache_ttl = NEGATIVE_CACHE_TTL; }
+    if(!strcmp(key, "coalesce_timeout")) { if( !sscanf(val, "%u" , &(options->coalesce_timeout) )) options->coalesce_timeout = COALESCE_TIMEOUT; }
+    if(!strcmp(key, "cega_max_response")) { if( !sscanf(val, "%u" , &(options->cega_max_response) )) options->cega_max_response = CEGA_MAX_RESPONSE; }
+    if(!strcmp(key, "cega_batch_size")) { if( !sscanf(val, "%u" , &(options->cega_batch_size) ) || !options->cega_batch_size) options->cega_batch_size = CEGA_BATCH_SIZE; }
+    if(!strcmp(key, "cega_timeout"  )) { if( !sscanf(val, "%u" , &(options->cega_timeout) )) options->cega_timeout = CEGA_REQUEST_TIMEOUT; }
+    if(!strcmp(key, "cache_grace"   )) { if( !sscanf(val, "%u" , &(options->cache_grace) )) options->cache_grace = CACHE_GRACE; }
+    if(!strcmp(key, "db_mmap_size"  )) { if( !sscanf(val, "%u" , &(options->db_mmap_size) )) options->db_mmap_size = DB_MMAP_SIZE; }
+    if(!strcmp(key, "db_cache_size" )) { if( !sscanf(val, "%u" , &(options->db_cache_size) )) options->db_cache_size = DB_CACHE_SIZE; }
+    if(!strcmp(key, "shm_slots"     )) { if( !sscanf(val, "%u" , &(options->shm_slots) )) options->shm_slots = SHM_SLOTS; }
+    if(!strcmp(key, "db_busy_timeout")) { if( !sscanf(val, "%u" , &(options->db_busy_timeout) )) options->db_busy_timeout = DB_BUSY_TIMEOUT; }
+    if(!strcmp(key, "refresh_concurrency")) { if( !sscanf(val, "%u" , &(options->refresh_concurrency) )) options->refresh_concurrency = REFRESH_CONCURRENCY; }
+    if(!strcmp(key, "cache_purge_interval")) { if( !sscanf(val, "%u" , &(options->cache_purge_interval) )) options->cache_purge_interval = CACHE_PURGE_INTERVAL; }
+    if(!strcmp(key, "cache_max_entries")) { if( !sscanf(val, "%u" , &(options->cache_max_entries) )) options->cache_max_entries = CACHE_MAX_ENTRIES; }
     if(!strcmp(key, "ega_gid"       )) { if( !sscanf(val, "%u" , &(options->gid)   )) options->gid = -1; }
    
     INJECT_OPTION(key, "db_path"           , val, options->db_path          );
+    INJECT_OPTION(key, "db_synchronous"    , val, options->db_synchronous   );
+    INJECT_OPTION(key, "index_path"        , val, options->index_path       );
+    INJECT_OPTION(key, "shm_name"          , val, options->shm_name         );
     INJECT_OPTION(key, "ega_dir"           , val, options->ega_dir          );
     INJECT_OPTION(key, "prompt"            , val, options->prompt           );
     INJECT_OPTION(key, "ega_shell"         , val, options->shell            );
     INJECT_OPTION(key, "cega_endpoint_username", val, options->cega_endpoint_username);
     INJECT_OPTION(key, "cega_endpoint_uid" , val, options->cega_endpoint_uid);
+    INJECT_OPTION(key, "cega_endpoint_changes", val, options->cega_endpoint_changes);
+    INJECT_OPTION(key, "cega_endpoint_username_batch", val, options->cega_endpoint_username_batch);
+    INJECT_OPTION(key, "cega_endpoint_uid_batch", val, options->cega_endpoint_uid_batch);
     INJECT_OPTION(key, "cega_creds"        , val, options->cega_creds       );
     INJECT_OPTION(key, "cega_json_prefix"  , val, options->cega_json_prefix );
     INJECT_OPTION(key, "ssl_cert"          , val, options->ssl_cert         );
@@ -150,12 +212,50 @@ readconfig(FILE* fp, char* buffer, size_t buflen)
     options->cega_endpoint_username_len = strlen(options->cega_endpoint_username) - 1; /* count away %u, add \0 */
   if(options->cega_endpoint_uid)
     options->cega_endpoint_uid_len = strlen(options->cega_endpoint_uid) - 1; /* count away %u, add \0 */
+  if(options->cega_endpoint_changes)
+    options->cega_endpoint_changes_len = strlen(options->cega_endpoint_changes) - 1; /* count away %s, add \0 */
+  if(options->cega_endpoint_username_batch)
+    options->cega_endpoint_username_batch_len = strlen(options->cega_endpoint_username_batch) - 1; /* count away %s, add \0 */
+  if(options->cega_endpoint_uid_batch)
+    options->cega_endpoint_uid_batch_len = strlen(options->cega_endpoint_uid_batch) - 1; /* count away %s, add \0 */
 
   return 0;
 }
 
-bool
-loadconfig(void)
+/*
+ * Splits cega_json_prefix on the dots, once, so that the JSON parser
+ * walks the keys without copying or tokenizing the prefix.
+ * Empty keys are skipped. Returns 0 on success.
+ */
+static int
+_compile_json_prefix(void)
+{
+  const char *p = options->cega_json_prefix, *dot;
+  unsigned int n = 0;
+
+  options->cega_json_path = NULL;
+  options->cega_json_path_len = 0;
+  if(!p || !*p) return 0;
+
+  /* Count, at most */
+  for(dot = p; (dot = strchr(dot, CEGA_JSON_PREFIX_DELIM)); dot++, n++);
+  options->cega_json_path = malloc(sizeof(struct cega_json_key_s) * (n + 1));
+  if(!options->cega_json_path){ D3("Could not allocate the JSON path"); return 1; }
+
+  for(n = 0; *p; p = (*dot)?dot + 1:dot){
+    if(!(dot = strchr(p, CEGA_JSON_PREFIX_DELIM))) dot = p + strlen(p);
+    if(dot == p) continue; /* empty */
+    options->cega_json_path[n].key = p;
+    options->cega_json_path[n].len = dot - p;
+    D3("JSON prefix key %u: %.*s", n, options->cega_json_path[n].len, p);
+    n++;
+  }
+  options->cega_json_path_len = n;
+  return 0;
+}
+
+static bool
+_loadconfig(void)
 {
   D1("Loading configuration %s", CFGFILE);
   if(options){ D2("Already loaded [@ %p]", options); return true; }
@@ -167,9 +267,8 @@ loadconfig(void)
   fp = fopen(CFGFILE, "r");
   if (fp == NULL || errno == EACCES) { D2("Error accessing the config file: %s", strerror(errno)); return false; }
 
-  options = (options_t*)malloc(sizeof(options_t));
+  options = (options_t*)calloc(1, sizeof(options_t)); /* unset options are NULL */
   if(!options){ D3("Could not allocate options data structure"); return false; };
-  options->buffer = NULL;
 
 REALLOC:
   D3("Allocating buffer of size %zd", size);
@@ -181,9 +280,19 @@ REALLOC:
 
   if( readconfig(fp, options->buffer, size) < 0 ){
     size = size << 1; // double it
+    rewind(fp);
     goto REALLOC;
   }
 
+  if( _compile_json_prefix() ) return false;
+
+  /* A single leading slash, and no other: anything else is not portable, or not under /dev/shm */
+  if( options->shm_name &&
+      (options->shm_name[0] != '/' || !options->shm_name[1] || strchr(options->shm_name + 1, '/')) ){
+    D1("Invalid shm_name: %s (must be /name): shared cache disabled", options->shm_name);
+    options->shm_name = NULL;
+  }
+
   D2("Conf loaded [@ %p]", options);
 
 #ifdef DEBUG
@@ -192,3 +301,23 @@ REALLOC:
   return true;
 #endif
 }
+
+/*
+ * The configuration is loaded on first use, and only once,
+ * even when several threads look up users at the same time.
+ */
+static pthread_once_t config_once = PTHREAD_ONCE_INIT;
+static bool config_loaded = false;
+
+static void
+_loadconfig_once(void)
+{
+  config_loaded = _loadconfig();
+}
+
+bool
+loadconfig(void)
+{
+  pthread_once(&config_once, _loadconfig_once);
+  return config_loaded;
+}
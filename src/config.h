@@ -5,6 +5,12 @@
 #include <stdbool.h>
 #include <sys/types.h> 
 
+/* A key of cega_json_prefix (not NUL-terminated) */
+struct cega_json_key_s {
+  const char* key;
+  int len;
+};
+
 struct options_s {
   char* cfgfile;
   char* buffer;
@@ -14,8 +20,22 @@ struct options_s {
   char* prompt;            /* Please enter password */
   char* shell;             /* Please enter password */
   unsigned int cache_ttl;  /* How long a cache entry is valid (in seconds) */
+  unsigned int cache_ttl_jitter; /* How much of cache_ttl is taken off at random (in percent) */
+  unsigned int cache_refresh_ahead; /* A hit in that last part of cache_ttl refreshes the entry (in percent). 0 to disable */
+  unsigned int negative_cache_ttl; /* How long an unknown user is remembered (in seconds). 0 to disable */
+  unsigned int cache_grace; /* How long an expired entry is still served, while refreshed in the background (in seconds) */
+  unsigned int refresh_concurrency; /* How many background refreshes at most */
+  unsigned int cache_purge_interval; /* How often the expired entries are deleted (in seconds). 0 to disable */
+  unsigned int cache_max_entries; /* How many users the cache holds at most. 0 for no limit */
 
   char* db_path;           /* db file path */
+  unsigned int db_busy_timeout; /* How long to wait for another process writing to the database (in milliseconds) */
+  unsigned int db_mmap_size;    /* How much of the database is memory-mapped (in bytes). 0 to disable */
+  unsigned int db_cache_size;   /* Page cache per connection (in KiB) */
+  char* db_synchronous;         /* SQLite synchronous mode: off, normal or full */
+  char* index_path;        /* NSS lookup index file path. NULL to disable */
+  char* shm_name;          /* Shared memory cache name, starting with a /. NULL to disable */
+  unsigned int shm_slots;  /* How many users fit in the shared memory cache */
 
   /* Homedir */
   char* ega_dir;           /* EGA main inbox directory */
@@ -30,7 +50,24 @@ struct options_s {
   char* cega_endpoint_uid;      /* string format with one %s, replaced by uid      | idem */
   size_t cega_endpoint_uid_len; /* its length, -2 (for %s) */
 
+  char* cega_endpoint_changes;  /* string format with one %s, replaced by a timestamp | returns the users changed since then. NULL to disable */
+  size_t cega_endpoint_changes_len; /* its length, -2 (for %s) */
+
+  char* cega_endpoint_username_batch; /* string format with one %s, replaced by comma-separated usernames | returns a JSON array of users. NULL to disable */
+  size_t cega_endpoint_username_batch_len; /* its length, -2 (for %s) */
+
+  char* cega_endpoint_uid_batch; /* string format with one %s, replaced by comma-separated uids | idem */
+  size_t cega_endpoint_uid_batch_len; /* its length, -2 (for %s) */
+
+  unsigned int cega_batch_size; /* How many users at most in one request to a batch endpoint */
+  unsigned int cega_timeout; /* Requests to CentralEGA taking longer are aborted (in seconds, 0 for never) */
+
   char* cega_json_prefix;  /* Searching for the data rooted at this prefix */
+  struct cega_json_key_s* cega_json_path; /* that prefix, split on the dots */
+  unsigned int cega_json_path_len;
+
+  unsigned int coalesce_timeout; /* How long to wait for another process fetching the same user (in seconds). 0 to disable */
+  unsigned int cega_max_response; /* Larger answers from CentralEGA are refused (in bytes) */
 
   char* cega_creds;        /* for authentication: user:password */
   char* ssl_cert;          /* path the SSL certificate to contact Central EGA */
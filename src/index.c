@@ -0,0 +1,316 @@
+#define _GNU_SOURCE /* for mkostemp */
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "utils.h"
+#include "config.h"
+#include "index.h"
+#include "pwent.h"
+
+/*
+ * File layout
+ *
+ *   struct index_header_s
+ *   uint32_t by_name[nslots]   open addressing (linear probing) on hash_str(username)
+ *   uint32_t by_uid[nslots]    open addressing (linear probing) on the uid
+ *   records                    struct index_record_s and struct pwent_s, 4-bytes aligned
+ *
+ * A slot holds the offset of a record in the file, or 0 when empty.
+ * The tables are at most half full, so that a miss stops quickly.
+ *
+ * The records hold pre-serialized passwd entries (see pwent.h).
+ * The fingerprint of the settings they were built with is in the header,
+ * and an index built with other settings is ignored.
+ */
+
+#define INDEX_MAGIC 0x49474745 /* EGGI */
+#define INDEX_VERSION 2
+
+struct index_header_s {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t fingerprint;
+  uint32_t nslots;  /* power of 2 */
+  uint64_t size;    /* of the whole file */
+};
+
+struct index_record_s {
+  uint32_t hash;    /* of the username */
+  uint32_t len;     /* of the entry */
+  /* followed by the struct pwent_s */
+};
+
+#define INDEX_ALIGN(n) (((n) + 3) & ~((size_t)3))
+
+static inline uint32_t
+_hash_uid(uid_t uid)
+{
+  return (uint32_t)uid * 2654435761u; /* Knuth */
+}
+
+
+/*
+ * Lookups
+ *
+ * The index is mapped on first use, and we check at most once per second
+ * whether it has been replaced.
+ */
+
+static pthread_rwlock_t map_lock = PTHREAD_RWLOCK_INITIALIZER;
+static const char* map = NULL;
+static size_t map_size = 0;
+static dev_t map_dev = 0;
+static ino_t map_ino = 0;
+static time_t map_checked = 0;
+
+static void
+_unmap(void)
+{
+  if(map) munmap((void*)map, map_size);
+  map = NULL;
+  map_size = 0;
+  map_ino = 0;
+}
+
+/* Called with the write lock */
+static void
+_remap(void)
+{
+  struct stat st;
+  if(stat(options->index_path, &st)){ D3("No index at %s", options->index_path); _unmap(); return; }
+  if(map && st.st_dev == map_dev && st.st_ino == map_ino){ return; } /* unchanged */
+
+  _unmap();
+
+  int fd = open(options->index_path, O_RDONLY | O_CLOEXEC);
+  if(fd < 0){ D1("Could not open %s: %s", options->index_path, strerror(errno)); return; }
+  if(fstat(fd, &st) || (size_t)st.st_size < sizeof(struct index_header_s)){ close(fd); return; }
+
+  void* m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(m == MAP_FAILED){ D1("Could not map %s: %s", options->index_path, strerror(errno)); return; }
+
+  const struct index_header_s* hdr = (const struct index_header_s*)m;
+  if( hdr->magic != INDEX_MAGIC || hdr->version != INDEX_VERSION || hdr->size != (uint64_t)st.st_size ||
+      !hdr->nslots || (hdr->nslots & (hdr->nslots - 1)) ||
+      sizeof(*hdr) + 2 * (uint64_t)hdr->nslots * sizeof(uint32_t) > hdr->size ){
+    D1("Invalid index: %s", options->index_path);
+    munmap(m, st.st_size);
+    return;
+  }
+  if( hdr->fingerprint != pwent_fingerprint() ){
+    D1("Index built with other settings: ignoring %s", options->index_path);
+    munmap(m, st.st_size);
+    return;
+  }
+
+  D2("Mapped index %s [%u slots]", options->index_path, hdr->nslots);
+  map = (const char*)m;
+  map_size = st.st_size;
+  map_dev = st.st_dev;
+  map_ino = st.st_ino;
+}
+
+/* Returns the header with the read lock held, or NULL (and no lock) */
+static const struct index_header_s*
+_acquire(void)
+{
+  if(!loadconfig() || !options->index_path) return NULL;
+
+  time_t now = time(NULL);
+  if(__atomic_load_n(&map_checked, __ATOMIC_ACQUIRE) != now){
+    pthread_rwlock_wrlock(&map_lock);
+    if(map_checked != now){ _remap(); __atomic_store_n(&map_checked, now, __ATOMIC_RELEASE); }
+    pthread_rwlock_unlock(&map_lock);
+  }
+
+  pthread_rwlock_rdlock(&map_lock);
+  if(!map){ pthread_rwlock_unlock(&map_lock); return NULL; }
+  return (const struct index_header_s*)map;
+}
+
+/*
+ * Returns the record at offset <off>, or NULL if it does not fit in the file.
+ * Its entry is fully checked by pwent_copy(), we only make sure here
+ * that the username can be compared.
+ */
+static inline const struct index_record_s*
+_record(uint32_t off)
+{
+  if(off < sizeof(struct index_header_s) || off + sizeof(struct index_record_s) > map_size) return NULL;
+  const struct index_record_s* rec = (const struct index_record_s*)(map + off);
+  if(rec->len <= sizeof(struct pwent_s) || off + sizeof(*rec) + rec->len > map_size ||
+     ((const char*)(rec + 1))[rec->len - 1] != '\0') return NULL;
+  return rec;
+}
+
+#define ENTRY(rec) ((const struct pwent_s*)((rec) + 1))
+
+int
+index_getpwnam_r(const char* username, struct passwd *result, char *buffer, size_t buflen)
+{
+  const struct index_header_s* hdr = _acquire();
+  if(!hdr) return 1;
+
+  int rc = 1;
+  const uint32_t* slots = (const uint32_t*)(hdr + 1);
+  uint32_t mask = hdr->nslots - 1;
+  uint32_t h = hash_str(username);
+  uint32_t i, n;
+  for(i = h & mask, n = 0; n < hdr->nslots && slots[i]; i = (i + 1) & mask, n++){
+    const struct index_record_s* rec = _record(slots[i]);
+    if(!rec){ D1("Corrupted index record"); break; }
+    if(rec->hash == h && !strcmp(ENTRY(rec)->data, username)){ rc = pwent_copy(ENTRY(rec), rec->len, result, buffer, buflen); break; }
+  }
+
+  pthread_rwlock_unlock(&map_lock);
+  return rc;
+}
+
+int
+index_getpwuid_r(uid_t uid, struct passwd *result, char *buffer, size_t buflen)
+{
+  const struct index_header_s* hdr = _acquire();
+  if(!hdr) return 1;
+
+  int rc = 1;
+  const uint32_t* slots = (const uint32_t*)(hdr + 1) + hdr->nslots;
+  uint32_t mask = hdr->nslots - 1;
+  uint32_t i, n;
+  for(i = _hash_uid(uid) & mask, n = 0; n < hdr->nslots && slots[i]; i = (i + 1) & mask, n++){
+    const struct index_record_s* rec = _record(slots[i]);
+    if(!rec){ D1("Corrupted index record"); break; }
+    if(ENTRY(rec)->uid == uid){ rc = pwent_copy(ENTRY(rec), rec->len, result, buffer, buflen); break; }
+  }
+
+  pthread_rwlock_unlock(&map_lock);
+  return rc;
+}
+
+
+/*
+ * Building
+ *
+ * The records are accumulated in memory, and written with the tables
+ * into a temporary file, which is then renamed over the index.
+ * Readers either see the old index or the new one.
+ */
+
+static pthread_mutex_t build_lock = PTHREAD_MUTEX_INITIALIZER;
+static char* records = NULL;    /* as in the file */
+static size_t records_size = 0;
+static size_t records_max = 0;
+static uint32_t* offsets = NULL; /* of each record, in <records> */
+static uint32_t count = 0;
+static uint32_t count_max = 0;
+
+static void
+_reset(void)
+{
+  free(records); records = NULL; records_size = records_max = 0;
+  free(offsets); offsets = NULL; count = count_max = 0;
+}
+
+int
+index_begin(void)
+{
+  if(!loadconfig() || !options->index_path) return 1;
+  pthread_mutex_lock(&build_lock);
+  _reset();
+  return 0;
+}
+
+int
+index_add(const char* username, uid_t uid, const char* gecos)
+{
+  size_t size = pwent_size(username, gecos);
+  if(!size){ D1("Entry too large for the index: %s", username); return 1; }
+
+  size_t len = INDEX_ALIGN(sizeof(struct index_record_s) + size);
+  if(records_size + len > records_max){
+    records_max = (records_max)?(records_max << 1):4096;
+    while(records_size + len > records_max) records_max <<= 1;
+    char* r = realloc(records, records_max);
+    if(!r){ D1("Memory allocation error"); return 1; }
+    records = r;
+  }
+  if(count == count_max){
+    count_max = (count_max)?(count_max << 1):64;
+    uint32_t* o = realloc(offsets, count_max * sizeof(uint32_t));
+    if(!o){ D1("Memory allocation error"); return 1; }
+    offsets = o;
+  }
+
+  struct index_record_s* rec = (struct index_record_s*)(records + records_size);
+  memset(rec, 0, len);
+  rec->hash = hash_str(username);
+  rec->len = size;
+  pwent_fill((struct pwent_s*)(rec + 1), username, uid, gecos);
+
+  offsets[count++] = records_size;
+  records_size += len;
+  return 0;
+}
+
+int
+index_commit(void)
+{
+  int rc = 1;
+  int fd = -1;
+  uint32_t* slots = NULL;
+  char* tmp = strjoina(options->index_path, ".XXXXXX");
+
+  struct index_header_s hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = INDEX_MAGIC;
+  hdr.version = INDEX_VERSION;
+  hdr.fingerprint = pwent_fingerprint();
+  hdr.nslots = 16;
+  while(hdr.nslots < 2 * count) hdr.nslots <<= 1;
+
+  size_t tables = 2 * (size_t)hdr.nslots * sizeof(uint32_t);
+  size_t base = sizeof(hdr) + tables; /* where the records start */
+  hdr.size = base + records_size;
+  if(hdr.size > UINT32_MAX){ D1("Index too large"); goto BAILOUT; }
+
+  slots = calloc(2 * hdr.nslots, sizeof(uint32_t));
+  if(!slots){ D1("Memory allocation error"); goto BAILOUT; }
+
+  uint32_t mask = hdr.nslots - 1;
+  uint32_t i, j;
+  for(i = 0; i < count; i++){
+    const struct index_record_s* rec = (const struct index_record_s*)(records + offsets[i]);
+    uint32_t off = base + offsets[i];
+    for(j = rec->hash & mask; slots[j]; j = (j + 1) & mask);
+    slots[j] = off;
+    for(j = _hash_uid(ENTRY(rec)->uid) & mask; slots[hdr.nslots + j]; j = (j + 1) & mask);
+    slots[hdr.nslots + j] = off;
+  }
+
+  fd = mkostemp(tmp, O_CLOEXEC);
+  if(fd < 0){ D1("Could not create %s: %s", tmp, strerror(errno)); goto BAILOUT; }
+  if( fchmod(fd, 0644) ||
+      write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+      write(fd, slots, tables) != (ssize_t)tables ||
+      (records_size && write(fd, records, records_size) != (ssize_t)records_size) ){
+    D1("Could not write %s: %s", tmp, strerror(errno));
+    unlink(tmp);
+    goto BAILOUT;
+  }
+  if(rename(tmp, options->index_path)){ D1("Could not rename %s: %s", tmp, strerror(errno)); unlink(tmp); goto BAILOUT; }
+
+  D2("Index rebuilt with %u users", count);
+  rc = 0;
+
+BAILOUT:
+  if(fd >= 0) close(fd);
+  free(slots);
+  _reset();
+  pthread_mutex_unlock(&build_lock);
+  return rc;
+}
@@ -0,0 +1,29 @@
+#ifndef __LEGA_INDEX_H_INCLUDED__
+#define __LEGA_INDEX_H_INCLUDED__
+
+#include <pwd.h>
+
+/*
+ * Read-only lookup index, memory-mapped by the NSS module.
+ *
+ * A snapshot of the users table, rebuilt by root after each change
+ * and swapped in by rename. Disabled when index_path is not set.
+ */
+
+/*
+ * Both return -1 in case the buffer is too small,
+ * 0 when found, and 1 when the user is not in the index.
+ */
+int index_getpwnam_r(const char* username, struct passwd *result, char *buffer, size_t buflen);
+int index_getpwuid_r(uid_t uid, struct passwd *result, char *buffer, size_t buflen);
+
+/*
+ * Building a new index:
+ * call index_add for each user, between index_begin and index_commit.
+ * They return 0 on success.
+ */
+int index_begin(void);
+int index_add(const char* username, uid_t uid, const char* gecos);
+int index_commit(void);
+
+#endif /* !__LEGA_INDEX_H_INCLUDED__ */
@@ -4,8 +4,6 @@
 #include "config.h"
 #include "json.h"
 
-#define CEGA_JSON_PREFIX_DELIM "."
-
 /* Will search for options->cega_json_prefix first, and then those exact ones */
 #define CEGA_JSON_USER  "username"
 #define CEGA_JSON_UID   "uid"
@@ -21,145 +19,265 @@
                                               "Undefined")
 #endif
 
-static int
-get_size(jsmntok_t *t){
-  int i, j;
-  if (t->type == JSMN_PRIMITIVE || t->type == JSMN_STRING) {
-    if(t->size > 0) return get_size(t+1)+1;
-    return 1;
-  } else if (t->type == JSMN_OBJECT || t->type == JSMN_ARRAY) {
-    j = 0;
-    for (i = 0; i < t->size; i++) { j += get_size(t+1+j); }
-    return j+1;
-  } else {
-    D1("get_size: weird type %s", TYPE2STR(t->type));
-    return 1000000;
-  }
+#define KEYNEQ(json, t, s, len) ((len) == ((t)->end - (t)->start) && strncmp((json) + (t)->start, s, len) == 0)
+#define KEYEQ(json, t, s) KEYNEQ(json, t, s, (int)strlen(s))
+
+/*
+ * Streaming
+ *
+ * jsmn resumes where it stopped when it is called again on a longer document,
+ * so the tokens are built as the document arrives. Strings and numbers cut
+ * at the end are taken again on the next call (jsmn is built with JSMN_STRICT,
+ * otherwise a number would end where the data ends).
+ * The tokens start on the stack, and move to the heap when they do not fit.
+ */
+
+void
+json_stream_init(struct json_stream_s* s)
+{
+  jsmn_init(&s->parser);
+  s->tokens = s->stack;
+  s->max = JSON_STACK_TOKENS;
+  s->status = 1;
+  s->fed = 0;
 }
 
-#define KEYEQ(json, t, s) ((int)strlen(s) == ((t)->end - (t)->start)) && strncmp((json) + (t)->start, s, (t)->end - (t)->start) == 0
+void
+json_stream_free(struct json_stream_s* s)
+{
+  if(s->tokens != s->stack){ D3("Freeing tokens at %p", s->tokens); free(s->tokens); }
+  s->tokens = s->stack;
+}
 
 int
-parse_json(const char* json, int jsonlen,
-	   char** username, char** pwd, char** pbk, char** gecos, int* uid)
+json_stream_feed(struct json_stream_s* s, const char* json, int jsonlen)
 {
-  jsmn_parser jsonparser; /* on the stack */
-  jsmntok_t *tokens = NULL; /* array of tokens */
-  char* prefix = NULL;
-  size_t size_guess = 11; /* 5*2 (key:value) + 1(object) */
-  int r, rc=1;
-
-REALLOC:
-  /* Initialize parser (for every guess) */
-  jsmn_init(&jsonparser);
-  D2("Guessing with %zu tokens", size_guess);
-  if(tokens)free(tokens);
-  tokens = malloc(sizeof(jsmntok_t) * size_guess);
-  if (tokens == NULL) { D1("memory allocation error"); goto BAILOUT; }
-  r = jsmn_parse(&jsonparser, json, jsonlen, tokens, size_guess);
-  if (r < 0) { /* error */
-    D2("JSON parsing error: %s", (r == JSMN_ERROR_INVAL)? "JSON string is corrupted" :
-                                 (r == JSMN_ERROR_PART) ? "Incomplete JSON string":
-                                 (r == JSMN_ERROR_NOMEM)? "Not enough space in token array":
-                                                          "Unknown error");
-    if (r == JSMN_ERROR_NOMEM) {
-      size_guess = size_guess * 2; /* double it */
-      goto REALLOC;
-    }
-    goto BAILOUT;
+  int r;
+  if(s->status != 1) return s->status; /* complete, or invalid */
+
+  /* jsmn rescans a token cut at the end from its start (eg a long string):
+   * no need to call it until the new bytes can end that token */
+  int i = s->fed;
+  s->fed = jsonlen;
+  while( i < jsonlen && !strchr("\"{}[],: \t\r\n", json[i]) ) i++;
+  if( i == jsonlen ) return 1;
+
+  while( (r = jsmn_parse(&s->parser, json, jsonlen, s->tokens, s->max)) == JSMN_ERROR_NOMEM ){
+    unsigned int max = s->max << 1;
+    D2("Growing to %u tokens", max);
+    jsmntok_t* tokens = (s->tokens == s->stack)?malloc(sizeof(jsmntok_t) * max):realloc(s->tokens, sizeof(jsmntok_t) * max);
+    if (tokens == NULL) { D1("memory allocation error"); return (s->status = -1); }
+    if (s->tokens == s->stack) memcpy(tokens, s->stack, sizeof(s->stack));
+    s->tokens = tokens;
+    s->max = max;
   }
 
-  /* Valid response */
-  D3("%d tokens found", r);
-  if( tokens->type != JSMN_OBJECT ){ D1("JSON object expected"); rc = 1; goto BAILOUT; }
-  if( r<7 ){ D1("We should get at least 7 tokens"); rc = 1; goto BAILOUT; }
-
-  /* Find root token given the CentralEGA prefix */
-  prefix = strdup(options->cega_json_prefix); /* strtok modifies the str, so making copy */
-  if (prefix == NULL) { D1("memory allocation error"); goto BAILOUT; }
-  char* prefix2 = prefix; /* Trick from https://stackoverflow.com/a/28686287/6401565 */
-  const char *part = strtok(prefix2, CEGA_JSON_PREFIX_DELIM);
-   
-  /* walk through other tokens */
-  jsmntok_t *t = tokens; /* use a sentinel and move inside the object */
-  int j=0, k=0;
-  while( j<r && part != NULL ) {
-    t++;
-    D3("Finding '%s' in JSON", part);
-    
-inspect:
-    if( KEYEQ(json, t, part) ) goto found;
-    D3("nope... %.*s [%d items]", t->end-t->start, json + t->start, t->size);
-    k=get_size(t+1)+1;
-    j+=k;
-    if( j>=r ){ D1("We have exhausted all the tokens"); rc = 1; goto BAILOUT; }
-    t+=k;
-    goto inspect;
-
-found:
-    D3( "%s found", part );
-    t++; /* next should be the root object or array */
-
-    /* In case the root is an array, fetch the first element */
-    if( t->type == JSMN_ARRAY ){ t++; }
-
-    /* We should now point to the root object */
-    if( t->type != JSMN_OBJECT ){ D1("JSON object expected, but got %s", TYPE2STR(t->type)); rc = 1; goto BAILOUT; }
-
-    part = strtok(NULL, CEGA_JSON_PREFIX_DELIM);
+  if (r == JSMN_ERROR_PART || r == 0) return 1; /* more to come */
+  if (r < 0) { /* error */
+    D2("JSON parsing error: %s", (r == JSMN_ERROR_INVAL)? "JSON string is corrupted" : "Unknown error");
+    return (s->status = -1);
   }
+  D3("%d tokens found", r);
+  return (s->status = 0);
+}
+
+/*
+ * Returns the token following t and everything it contains.
+ * The tokens are in document order, so that is the first one starting after t ends.
+ * A container not closed yet contains everything after it.
+ */
+static inline jsmntok_t*
+_next(jsmntok_t* t, const jsmntok_t* last)
+{
+  int end = t->end;
+  if(end < 0) return (jsmntok_t*)last;
+  for(t++; t < last && t->start < end; t++);
+  return t;
+}
 
-  if( j>=r ){ D1("We have exhausted all the tokens"); rc = 1; goto BAILOUT; }
+/*
+ * Returns the value rooted at options->cega_json_prefix, or NULL.
+ * On the way, in an array, we look into its first element.
+ */
+static jsmntok_t*
+_find_root(const char* json, jsmntok_t* t, const jsmntok_t* last)
+{
+  unsigned int k;
+  if( t >= last ) return NULL;
+  for(k = 0; k < options->cega_json_path_len; k++){
+    const struct cega_json_key_s* part = &options->cega_json_path[k];
+
+    if( t->type == JSMN_ARRAY && t->size ){ t++; }
+    if( t >= last || t->type != JSMN_OBJECT ){ D1("JSON object expected"); return NULL; }
+
+    D3("Finding '%.*s' in JSON", part->len, part->key);
+    int i, max = t->size;
+    for(i = 0, t++; i < max && t + 1 < last; i++, t = _next(t + 1, last)){ /* key and value */
+      if( KEYNEQ(json, t, part->key, part->len) ) break;
+      D3("nope... %.*s [%d items]", t->end-t->start, json + t->start, t->size);
+    }
+    if( i == max || t + 1 >= last ){ D1("We have exhausted all the tokens"); return NULL; }
+
+    D3( "%.*s found", part->len, part->key );
+    t++; /* the value */
+  }
 
   D1("ROOT %.*s [%d items]", t->end-t->start, json + t->start, t->size);
+  return t;
+}
+
+/* The root, or its first element in case it is an array. NULL if not there (yet) */
+static jsmntok_t*
+_find_user(const char* json, jsmntok_t* tokens, const jsmntok_t* last)
+{
+  jsmntok_t *t = _find_root(json, tokens, last);
+  if( !t ) return NULL;
+  if( t->type == JSMN_ARRAY && t->size ){ t++; }
+  if( t >= last ) return NULL;
+  if( t->type != JSMN_OBJECT ){ D1("JSON object expected, but got %s", TYPE2STR(t->type)); return NULL; }
+  return t;
+}
+
+bool
+json_stream_has_user(struct json_stream_s* s, const char* json)
+{
+  if( s->status < 0 ) return false;
+
+  const jsmntok_t *last = s->tokens + s->parser.toknext;
+  jsmntok_t *t = _find_user(json, s->tokens, last);
+  if( !t ) return false;
+  if( t->end >= 0 ) return true; /* closed */
+
+  /* or all the known keys are there, with their values */
+  unsigned int seen = 0;
+  int i, max = t->size;
+  for (i = 0, t++; i < max && t + 1 < last; i++, t = _next(t + 1, last)) {
+    if(t->type != JSMN_STRING || t[1].end < 0) continue; /* the value must be complete too */
+    if( KEYEQ(json, t, CEGA_JSON_USER)  ) seen |= 1;
+    if( KEYEQ(json, t, CEGA_JSON_UID)   ) seen |= 2;
+    if( KEYEQ(json, t, CEGA_JSON_PWD)   ) seen |= 4;
+    if( KEYEQ(json, t, CEGA_JSON_PBK)   ) seen |= 8;
+    if( KEYEQ(json, t, CEGA_JSON_GECOS) ) seen |= 16;
+  }
+  return seen == 31;
+}
 
+/* Points <s> at the value <v>, and terminates it in place. A null value is left out */
+static inline void
+_view(char* json, const jsmntok_t* v, struct json_str_s* s, const char* name)
+{
+  if(s->ptr){ D3("Strange! I already have %s", name); return; }
+  if(v->type != JSMN_STRING && v->type != JSMN_PRIMITIVE){ D2("%s is not a string: %s", name, TYPE2STR(v->type)); return; }
+  if(v->type == JSMN_PRIMITIVE && json[v->start] == 'n'){ D3("%s is null", name); return; }
+  s->ptr = json + v->start;
+  s->len = v->end - v->start;
+  json[v->end] = '\0'; /* over the closing quote, or the delimiter after a primitive */
+}
+
+/*
+ * Extracts the user from the object at t. Returns the number of errors.
+ * When the object is not closed (the rest was not downloaded), the keys so far are used.
+ */
+static int
+_parse_object(char* json, jsmntok_t* t, const jsmntok_t* last, struct json_user_s* user)
+{
+  bool closed = (t->end >= 0);
   int max = t->size;
-  /* if( max<5 ){ D1("Invalid JSON"); rc = 1; goto BAILOUT; } */
-  int i;
+  /* if( max<5 ){ D1("Invalid JSON"); return 1; } */
+  int i, rc = 0; /* assume success */
+
+  memset(user, 0, sizeof(*user));
+  user->uid = -1;
+
   t++; /* move inside the root */
-  rc = 0; /* assume success */
-  for (i = 0; i < max; i++, t+=t->size+1) {
-
-    if(t->type == JSMN_STRING){
-
-      if( KEYEQ(json, t, CEGA_JSON_USER) ){
-	t+=t->size; /* get to the value */
-	if(*username){ D3("Strange! I already have username"); continue; }
-	*username = strndup(json + t->start, t->end-t->start);
-      } else if( KEYEQ(json, t, CEGA_JSON_PWD) ){
-	t+=t->size; /* get to the value */
-	if(*pwd){ D3("Strange! I already have pwd"); continue; }
-	*pwd = strndup(json + t->start, t->end-t->start);
-      } else if( KEYEQ(json, t, CEGA_JSON_GECOS) ){
-	t+=t->size; /* get to the value */
-	if(*gecos){ D3("Strange! I already have gecos"); continue; }
-	*gecos = strndup(json + t->start, t->end-t->start);
-      } else if( KEYEQ(json, t, CEGA_JSON_PBK) ){
-	t+=t->size; /* get to the value */
-	if(*pbk){ D3("Strange! I already have pbk"); continue; }
-	*pbk = strndup(json + t->start, t->end-t->start);
-      } else if( KEYEQ(json, t, CEGA_JSON_UID) ){
-	t+=t->size; /* get to the value */
-	char* cend;
-	*uid = strtol(json + t->start, (char**)&cend, 10); /* reuse cend above */
-	if( (cend != (json + t->end)) ) *uid=-1; /* error when cend does not point to end+1 */
-      } else {
-	D3("Unexpected key: %.*s with %d items", t->end-t->start, json + t->start, t->size);
-	t+=t->size; /* get to the value */
-	D3("of type %s with %d items", TYPE2STR(t->type), t->size);
-      }
+  for (i = 0; i < max && t + 1 < last; i++, t = _next(t + 1, last)) { /* key and value */
+
+    if(t->type != JSMN_STRING){ D2("Not a string token"); rc++; continue; }
+
+    jsmntok_t* v = t + 1; /* the value */
+    if(v->end < 0){ D2("Unterminated value"); rc++; continue; } /* a container still open, when stopped early */
+    if( KEYEQ(json, t, CEGA_JSON_USER) ){
+      _view(json, v, &user->username, "username");
+    } else if( KEYEQ(json, t, CEGA_JSON_PWD) ){
+      _view(json, v, &user->pwd, "pwd");
+    } else if( KEYEQ(json, t, CEGA_JSON_GECOS) ){
+      _view(json, v, &user->gecos, "gecos");
+    } else if( KEYEQ(json, t, CEGA_JSON_PBK) ){
+      _view(json, v, &user->pbk, "pbk");
+    } else if( KEYEQ(json, t, CEGA_JSON_UID) ){
+      char* cend;
+      user->uid = strtol(json + v->start, (char**)&cend, 10);
+      if( (cend != (json + v->end)) ) user->uid=-1; /* error when cend does not point to end+1 */
     } else {
-      D2("Not a string token");
-      rc++;
+      D3("Unexpected key: %.*s, of type %s with %d items", t->end-t->start, json + t->start, TYPE2STR(v->type), v->size);
     }
   }
+  if( i < max && closed ){ D1("We have exhausted all the tokens"); rc++; }
 
 #ifdef DEBUG
   if(rc) D1("%d errors while parsing the root object", rc);
 #endif
+  return rc;
+}
+
+int
+json_stream_user(struct json_stream_s* s, char* json, struct json_user_s* user)
+{
+  int r = s->parser.toknext;
+
+  if( s->status < 0 ) return 1;
+  if( s->status && !json_stream_has_user(s, json) ){ D1("Incomplete JSON"); return 1; }
+
+  /* Valid response */
+  if( s->tokens->type != JSMN_OBJECT ){ D1("JSON object expected"); return 1; }
+  if( r<7 ){ D1("We should get at least 7 tokens"); return 1; }
+
+  jsmntok_t *t = _find_user(json, s->tokens, s->tokens + r);
+  if( !t ) return 1;
 
-BAILOUT:
-  if(tokens){ D3("Freeing tokens at %p", tokens); free(tokens); }
-  if(prefix){ D3("Freeing prefix at %p", prefix ); free(prefix); }
+  return _parse_object(json, t, s->tokens + r, user);
+}
+
+int
+json_stream_users(struct json_stream_s* s, char* json,
+		  int (*cb)(const struct json_user_s* user))
+{
+  if( s->status ){ D1("%s JSON", (s->status < 0)?"Invalid":"Incomplete"); return -1; }
+
+  const jsmntok_t *last = s->tokens + s->parser.toknext;
+  jsmntok_t *t = _find_root(json, s->tokens, last);
+  if( !t ) return -1;
+
+  int i, max = 1, rc = 0; /* a single user */
+  if( t->type == JSMN_ARRAY ){ max = t->size; t++; }
+
+  for(i = 0; i < max && t < last; i++, t = _next(t, last)){
+    struct json_user_s user;
+    if( t->type != JSMN_OBJECT ){ D1("JSON object expected, but got %s", TYPE2STR(t->type)); rc++; continue; }
+    if( _parse_object(json, t, last, &user) || cb(&user) ) rc++;
+  }
+  return rc;
+}
+
+int
+parse_json(char* json, int jsonlen, struct json_user_s* user)
+{
+  struct json_stream_s s;
+  json_stream_init(&s);
+  json_stream_feed(&s, json, jsonlen);
+  int rc = json_stream_user(&s, json, user);
+  json_stream_free(&s);
+  return rc;
+}
+
+int
+parse_json_users(char* json, int jsonlen,
+		 int (*cb)(const struct json_user_s* user))
+{
+  struct json_stream_s s;
+  json_stream_init(&s);
+  json_stream_feed(&s, json, jsonlen);
+  int rc = json_stream_users(&s, json, cb);
+  json_stream_free(&s);
   return rc;
 }
@@ -1,9 +1,75 @@
 #ifndef __LEGA_JSON_H_INCLUDED__
 #define __LEGA_JSON_H_INCLUDED__
 
+#include <stdbool.h>
+
 #include "jsmn/jsmn.h"
 
-int parse_json(const char* json, int jsonlen,
-	       char** username, char** pwd, char** pbk, char** gecos, int* uid);
+/*
+ * A string in the JSON document: not copied, but NUL-terminated in place
+ * (over its closing quote). NULL when absent, or null.
+ */
+struct json_str_s {
+  char* ptr;
+  int len;
+};
+
+struct json_user_s {
+  struct json_str_s username;
+  struct json_str_s pwd;
+  struct json_str_s pbk;
+  struct json_str_s gecos;
+  int uid; /* -1 when absent */
+};
+
+/*
+ * Extracts the user rooted at cega_json_prefix (the first one, in an array).
+ * The document is modified, and the strings of <user> point into it.
+ * Returns the number of errors.
+ */
+int parse_json(char* json, int jsonlen, struct json_user_s* user);
+
+/*
+ * Calls cb for each user in the array rooted at cega_json_prefix (or for the single user there).
+ * Same as parse_json for the strings: they live as long as the document.
+ * Returns -1 when the document is invalid, or the number of users which were invalid or for which cb failed.
+ */
+int parse_json_users(char* json, int jsonlen,
+		     int (*cb)(const struct json_user_s* user));
+
+/*
+ * A document tokenized as it arrives, eg from the cURL write callback.
+ * Feed it the whole document so far, each time more of it comes in
+ * (the document may move in between: the tokens hold offsets).
+ */
+
+/* Enough for a user with a few extra keys, under a prefix */
+#define JSON_STACK_TOKENS 128
+
+struct json_stream_s {
+  jsmn_parser parser;
+  jsmntok_t* tokens;        /* <stack>, or allocated when that is too small */
+  unsigned int max;         /* how many fit in <tokens> */
+  int status;               /* as returned by json_stream_feed */
+  int fed;                  /* how much of the JSON was seen so far */
+  jsmntok_t stack[JSON_STACK_TOKENS];
+};
+
+void json_stream_init(struct json_stream_s* s);
+void json_stream_free(struct json_stream_s* s);
+
+/* Returns 0 when the document is complete, 1 when more is expected, and -1 when it is invalid */
+int json_stream_feed(struct json_stream_s* s, const char* json, int jsonlen);
+
+/*
+ * Whether the user at cega_json_prefix is there already: its object is closed,
+ * or it has all the known keys. The rest of the document is then not needed.
+ */
+bool json_stream_has_user(struct json_stream_s* s, const char* json);
+
+/* Same as parse_json and parse_json_users, on the tokens so far */
+int json_stream_user(struct json_stream_s* s, char* json, struct json_user_s* user);
+int json_stream_users(struct json_stream_s* s, char* json,
+		      int (*cb)(const struct json_user_s* user));
 
 #endif /* !__LEGA_JSON_H_INCLUDED__ */
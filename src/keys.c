@@ -4,6 +4,8 @@
 #include "utils.h"
 #include "backend.h"
 #include "cega.h"
+#include "client.h"
+#include "shmcache.h"
 
 int
 main(int argc, const char **argv)
@@ -15,9 +17,19 @@ main(int argc, const char **argv)
   const char* username = argv[1];
   REPORT("Fetching the public key of %s", username);
 
+  if(shmcache_print_pubkey(username)) return rc;
+
+  /* ask ega-authd */
+  switch(client_print_pubkey(username)){
+  case AUTHD_FOUND:       return rc;
+  case AUTHD_UNAVAILABLE: break;
+  default:                return 1;
+  }
+
   /* check database */
   bool use_backend = backend_opened();
   if(use_backend && backend_print_pubkey(username)) return rc;
+  if(use_backend && backend_is_unknown_user(username)){ REPORT("User %s unknown to CentralEGA [cached]", username); return 1; }
 
   /* Defining the CentralEGA callback */
   int print_pubkey(char* uname, uid_t uid, char* password_hash, char* pubkey, char* gecos){
@@ -36,5 +48,13 @@ main(int argc, const char **argv)
   _cleanup_str_ char* endpoint = (char*)malloc((options->cega_endpoint_username_len + strlen(username)) * sizeof(char));
   if(!endpoint){ D1("Memory allocation error"); return 1; }
   if(sprintf(endpoint, options->cega_endpoint_username, username) < 0){ D1("Endpoint formatting error"); return 2; }
-  return cega_resolve(endpoint, print_pubkey);
+  /* In case another process fetched it in the meantime */
+  int cached(void){
+    if(backend_print_pubkey(username)) return 0;
+    return (backend_is_unknown_user(username))?CEGA_NOT_FOUND:1;
+  }
+
+  rc = cega_resolve_coalesced(endpoint, (use_backend)?cached:NULL, print_pubkey);
+  if(rc == CEGA_NOT_FOUND && use_backend) backend_add_unknown_user(username);
+  return (rc)?1:0; /* not CEGA_NOT_FOUND, as an exit status */
 }
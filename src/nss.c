@@ -1,11 +1,83 @@
 #include <nss.h>
 #include <pwd.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "utils.h"
 #include "backend.h"
 #include "cega.h"
 #include "homedir.h"
+#include "client.h"
+#include "index.h"
+#include "shmcache.h"
+#include "pwent.h"
+
+/*
+ * Last user resolved from CentralEGA, in this process
+ *
+ * When the caller's buffer is too small, we return ERANGE and glibc retries
+ * with a larger buffer. The retry is served from here, instead of
+ * contacting CentralEGA again, in case the user could not be cached
+ * (eg the database is not writable).
+ * Only that retry: the same user, from the same thread, shortly after,
+ * and only once. Any other lookup goes through the usual checks.
+ */
+#define LAST_TTL 2 /* seconds */
+
+static pthread_mutex_t last_lock = PTHREAD_MUTEX_INITIALIZER;
+static char* last = NULL; /* struct pwent_s */
+static size_t last_len = 0;
+static time_t last_time = 0;
+static pthread_t last_thread;
+
+/* Copy the user in the caller's buffer, and remember it when it did not fit */
+static int
+_remember(const char* username, uid_t uid, const char* gecos,
+	  struct passwd *result, char *buffer, size_t buflen)
+{
+  size_t len = pwent_size(username, gecos);
+  if(!len) return 1;
+  char* ent = malloc(len);
+  if(!ent){ D1("Memory allocation error"); return 1; }
+  pwent_fill((struct pwent_s*)ent, username, uid, gecos);
+
+  int rc = pwent_copy(ent, len, result, buffer, buflen);
+  if(rc != -1){ free(ent); return rc; } /* no retry coming */
+
+  pthread_mutex_lock(&last_lock);
+  free(last);
+  last = ent;
+  last_len = len;
+  last_time = time(NULL);
+  last_thread = pthread_self();
+  pthread_mutex_unlock(&last_lock);
+  return rc;
+}
+
+/*
+ * Serve the retry of the last lookup, by name, or by uid when username is NULL.
+ * Returns -1 in case the buffer is still too small, 0 when found, and 1 otherwise.
+ */
+static int
+_recall(const char* username, uid_t uid, struct passwd *result, char *buffer, size_t buflen)
+{
+  int rc = 1;
+  if(!__atomic_load_n(&last, __ATOMIC_RELAXED)) return rc; /* the common case */
+
+  pthread_mutex_lock(&last_lock);
+  const struct pwent_s* ent = (const struct pwent_s*)last;
+  if(ent && pthread_equal(last_thread, pthread_self())){
+    if(time(NULL) - last_time <= LAST_TTL &&
+       ((username)?!strcmp(ent->data, username):(ent->uid == uid))){
+      rc = pwent_copy(ent, last_len, result, buffer, buflen);
+    }
+    if(rc != -1){ free(last); last = NULL; } /* served, or not a retry: it is over */
+  }
+  pthread_mutex_unlock(&last_lock);
+  return rc;
+}
+
 
 /*
  * passwd functions
@@ -25,12 +97,32 @@ _nss_ega_getpwuid_r(uid_t uid, struct passwd *result,
 
   if( uid == (uid_t)(-1) ){ D2("ignoring -1"); return NSS_STATUS_NOTFOUND; }
 
+  int rc = 1;
+
+#ifndef NSS_CORE /* otherwise, the front (nss_lazy.c) already checked the shared cache and the index, and asked ega-authd */
+  rc = shmcache_getpwuid_r(uid, result, buffer, buflen);
+  if( rc == -1 ){ D1("Buffer too small"); *errnop = ERANGE; return NSS_STATUS_TRYAGAIN; }
+  if( rc == 0  ){ REPORT("User id %u found in the shared cache", uid); *errnop = 0; return NSS_STATUS_SUCCESS; }
+
+  rc = index_getpwuid_r(uid, result, buffer, buflen);
+  if( rc == -1 ){ D1("Buffer too small"); *errnop = ERANGE; return NSS_STATUS_TRYAGAIN; }
+  if( rc == 0  ){ REPORT("User id %u found in the index", uid); *errnop = 0; return NSS_STATUS_SUCCESS; }
+
+  enum nss_status status;
+  if( client_nss_status(client_getpwuid_r(uid, result, buffer, buflen), &status, errnop) ){ REPORT("User id %u answered by ega-authd", uid); return status; }
+#endif
+
+  if( !loadconfig() ){ D1("Invalid configuration"); return NSS_STATUS_UNAVAIL; }
   uid_t ruid = uid - options->uid_shift; 
   D1("Looking up user id %u [remotely %u]", uid, ruid);
   if( ruid <= 0 ){ D2("... too low: ignoring"); return NSS_STATUS_NOTFOUND; }
 
+  rc = _recall(NULL, uid, result, buffer, buflen);
+  if( rc == -1 ){ *errnop = ERANGE; return NSS_STATUS_TRYAGAIN; }
+  if( rc == 0  ){ REPORT("User id %u just resolved", uid); *errnop = 0; return NSS_STATUS_SUCCESS; }
+
   bool use_backend = backend_opened();
-  int rc = 1;
+  rc = 1;
   if(use_backend){
     
     rc = backend_getpwuid_r(uid, result, buffer, buflen);
@@ -40,6 +132,7 @@ _nss_ega_getpwuid_r(uid_t uid, struct passwd *result,
   }
 
   if( getuid() != 0 ){ return NSS_STATUS_NOTFOUND; }
+  if( use_backend && backend_is_unknown_uid(uid) ){ D1("User id %u unknown to CentralEGA [cached]", uid); return NSS_STATUS_NOTFOUND; }
   D2("Ok, you are root, go go gadget \"fetch users from CentralEGA\"");
 
   /* Defining the callback */
@@ -52,21 +145,12 @@ _nss_ega_getpwuid_r(uid_t uid, struct passwd *result,
     }
 
     /* Add to database. Ignore result.
-     In case the buffer is too small later, it'll fetch the same data from the cache, next time. */
+     In case the buffer is too small, the retry is served from memory (see _recall). */
     if(use_backend) backend_add_user(uname, uid, password_hash, pubkey, gecos);
 
     /* Prepare the answer */
-    char* homedir = strjoina(options->ega_dir, "/", uname);
-    D1("User id %u [Username %s] [Homedir %s]", ega_uid, uname, homedir);
-    if( copy2buffer(uname, &(result->pw_name)   , &buffer, &buflen) < 0 ) { return -1; }
-    if( copy2buffer("x", &(result->pw_passwd), &buffer, &buflen) < 0 ){ return -1; }
-    result->pw_uid = uid;
-    result->pw_gid = options->gid;
-    if( copy2buffer(homedir, &(result->pw_dir)   , &buffer, &buflen) < 0 ) { return -1; }
-    if( copy2buffer(gecos,   &(result->pw_gecos) , &buffer, &buflen) < 0 ) { return -1; }
-    if( copy2buffer(options->shell, &(result->pw_shell), &buffer, &buflen) < 0 ) { return -1; }
-
-    return 0;
+    D1("User id %u [Username %s]", ega_uid, uname);
+    return _remember(uname, uid, gecos, result, buffer, buflen);
   }
 
   _cleanup_str_ char* endpoint = (char*)malloc((options->cega_endpoint_uid_len + 32) * sizeof(char));
@@ -75,9 +159,16 @@ _nss_ega_getpwuid_r(uid_t uid, struct passwd *result,
   if( sprintf(endpoint, options->cega_endpoint_uid, ruid) < 0 ){
     D1("Error formatting the endpoint"); return NSS_STATUS_NOTFOUND;
   }
-  rc = cega_resolve(endpoint, cega_callback);
+  /* In case another process fetched it in the meantime */
+  int cached(void){
+    int rc = backend_getpwuid_r(uid, result, buffer, buflen);
+    return (rc == 1 && backend_is_unknown_uid(uid))?CEGA_NOT_FOUND:rc;
+  }
+
+  rc = cega_resolve_coalesced(endpoint, (use_backend)?cached:NULL, cega_callback);
   if( rc == -1 ){ D1("Buffer too small"); *errnop = ERANGE; return NSS_STATUS_TRYAGAIN; }
-  if( rc > 0 ) { D1("User id %u not found in CentralEGA", uid); return NSS_STATUS_NOTFOUND; }
+  if( rc == CEGA_NOT_FOUND ){ if(use_backend) backend_add_unknown_uid(uid); }
+  if( rc != 0 ) { D1("User id %u not found in CentralEGA", uid); return NSS_STATUS_NOTFOUND; }
   *errnop = 0;
   return NSS_STATUS_SUCCESS;
 }
@@ -93,8 +184,32 @@ _nss_ega_getpwnam_r(const char *username, struct passwd *result,
   D1("Looking up '%s'", username);
   /* memset(buffer, '\0', buflen); */
 
-  bool use_backend = backend_opened();
   int rc = 1;
+
+#ifndef NSS_CORE /* otherwise, the front (nss_lazy.c) already checked the shared cache and the index, and asked ega-authd */
+  rc = shmcache_getpwnam_r(username, result, buffer, buflen);
+  if( rc == -1 ){ D1("Buffer too small"); *errnop = ERANGE; return NSS_STATUS_TRYAGAIN; }
+  if( rc == 0  ){ REPORT("User %s found in the shared cache", username); *errnop = 0; return NSS_STATUS_SUCCESS; }
+
+  rc = index_getpwnam_r(username, result, buffer, buflen);
+  if( rc == -1 ){ D1("Buffer too small"); *errnop = ERANGE; return NSS_STATUS_TRYAGAIN; }
+  if( rc == 0  ){ REPORT("User %s found in the index", username); *errnop = 0; return NSS_STATUS_SUCCESS; }
+
+  enum nss_status status;
+  if( client_nss_status(client_getpwnam_r(username, result, buffer, buflen), &status, errnop) ){ REPORT("User %s answered by ega-authd", username); return status; }
+#endif
+
+  rc = _recall(username, 0, result, buffer, buflen);
+  if( rc == -1 ){ *errnop = ERANGE; return NSS_STATUS_TRYAGAIN; }
+  if( rc == 0  ){
+    REPORT("User %s just resolved", username);
+    create_ega_dir(result); /* in case the first attempt could not */
+    *errnop = 0;
+    return NSS_STATUS_SUCCESS;
+  }
+
+  bool use_backend = backend_opened();
+  rc = 1;
   if(use_backend){
     
     rc = backend_getpwnam_r(username, result, buffer, buflen);
@@ -104,6 +219,7 @@ _nss_ega_getpwnam_r(const char *username, struct passwd *result,
   }
 
   if( getuid() != 0 ){ return NSS_STATUS_NOTFOUND; }
+  if( use_backend && backend_is_unknown_user(username) ){ D1("User %s unknown to CentralEGA [cached]", username); return NSS_STATUS_NOTFOUND; }
   D2("Ok, you are root, go go gadget \"fetch users from CentralEGA\"");
 
   /* Defining the callback */
@@ -116,19 +232,13 @@ _nss_ega_getpwnam_r(const char *username, struct passwd *result,
     }
 
     /* Add to database. Ignore result.
-     In case the buffer is too small later, it'll fetch the same data from the cache, next time. */
+     In case the buffer is too small, the retry is served from memory (see _recall). */
     if(use_backend) backend_add_user(username, uid, password_hash, pubkey, gecos);
 
     /* Prepare the answer */
-    char* homedir = strjoina(options->ega_dir, "/", username);
-    D1("Username %s [Homedir %s]", uname, homedir);
-    result->pw_name = (char*)username; /* no need to copy to buffer */
-    if( copy2buffer("x", &(result->pw_passwd), &buffer, &buflen) < 0 ){ return -1; }
-    result->pw_uid = uid;
-    result->pw_gid = options->gid;
-    if( copy2buffer(homedir, &(result->pw_dir)   , &buffer, &buflen) < 0 ) { return -1; }
-    if( copy2buffer(gecos,   &(result->pw_gecos) , &buffer, &buflen) < 0 ) { return -1; }
-    if( copy2buffer(options->shell, &(result->pw_shell), &buffer, &buflen) < 0 ) { return -1; }
+    D1("Username %s", uname);
+    int rc = _remember(username, uid, gecos, result, buffer, buflen);
+    if(rc) return rc;
   
     /* make sure the homedir is created */
     create_ega_dir(result); // ignore output, in nss case
@@ -140,9 +250,16 @@ _nss_ega_getpwnam_r(const char *username, struct passwd *result,
   if( sprintf(endpoint, options->cega_endpoint_username, username) < 0 ){
     D1("Error formatting the endpoint"); return NSS_STATUS_NOTFOUND;
   }
-  rc = cega_resolve(endpoint, cega_callback);
+  /* In case another process fetched it in the meantime */
+  int cached(void){
+    int rc = backend_getpwnam_r(username, result, buffer, buflen);
+    return (rc == 1 && backend_is_unknown_user(username))?CEGA_NOT_FOUND:rc;
+  }
+
+  rc = cega_resolve_coalesced(endpoint, (use_backend)?cached:NULL, cega_callback);
   if( rc == -1 ){ D1("Buffer too small"); *errnop = ERANGE; return NSS_STATUS_TRYAGAIN; }
-  if( rc > 0 ) { D1("User %s not found in CentralEGA", username); return NSS_STATUS_NOTFOUND; }
+  if( rc == CEGA_NOT_FOUND ){ if(use_backend) backend_add_unknown_user(username); }
+  if( rc != 0 ) { D1("User %s not found in CentralEGA", username); return NSS_STATUS_NOTFOUND; }
   REPORT("User %s found in CentralEGA", username);
   *errnop = 0;
   return NSS_STATUS_SUCCESS;
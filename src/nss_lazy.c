@@ -0,0 +1,93 @@
+#include <nss.h>
+#include <pwd.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <pthread.h>
+
+#include "utils.h"
+#include "client.h"
+#include "index.h"
+#include "shmcache.h"
+
+/*
+ * Thin NSS front, built with "make LAZY=1"
+ *
+ * Every process looking up a user loads the NSS module, so this one
+ * only links against libc: it checks the shared cache and the index
+ * (when configured), asks ega-authd, and, when the daemon
+ * is not running, loads the full module (with cURL and SQLite)
+ * and forwards the lookup to it.
+ */
+
+#ifndef EGA_NSS_CORE
+#define EGA_NSS_CORE "/usr/local/lib/ega/libnss_ega_core.so"
+#endif
+
+typedef enum nss_status (*getpwnam_f)(const char*, struct passwd*, char*, size_t, int*);
+typedef enum nss_status (*getpwuid_f)(uid_t, struct passwd*, char*, size_t, int*);
+
+static getpwnam_f core_getpwnam = NULL;
+static getpwuid_f core_getpwuid = NULL;
+static pthread_once_t core_once = PTHREAD_ONCE_INIT;
+
+/* Never unloaded: it is cleaned up when the process exits */
+static void
+_load_core(void)
+{
+  D2("Loading %s", EGA_NSS_CORE);
+  void* core = dlopen(EGA_NSS_CORE, RTLD_NOW | RTLD_LOCAL);
+  if(!core){ D1("Could not load %s: %s", EGA_NSS_CORE, dlerror()); return; }
+  core_getpwnam = (getpwnam_f)dlsym(core, "_nss_ega_getpwnam_r");
+  core_getpwuid = (getpwuid_f)dlsym(core, "_nss_ega_getpwuid_r");
+}
+
+/*
+ * passwd functions
+ */
+
+/* Not allowed */
+enum nss_status _nss_ega_setpwent (int stayopen){ D1("called"); return NSS_STATUS_UNAVAIL; }
+enum nss_status _nss_ega_endpwent(void){ D1("called"); return NSS_STATUS_UNAVAIL; }
+enum nss_status _nss_ega_getpwent_r(struct passwd *result, char *buffer, size_t buflen, int *errnop){ D1("called"); return NSS_STATUS_UNAVAIL; }
+
+enum nss_status
+_nss_ega_getpwuid_r(uid_t uid, struct passwd *result,
+		    char *buffer, size_t buflen, int *errnop)
+{
+  if( uid == (uid_t)(-1) ){ D2("ignoring -1"); return NSS_STATUS_NOTFOUND; }
+
+  int rc = shmcache_getpwuid_r(uid, result, buffer, buflen);
+  if( rc == -1 ){ D1("Buffer too small"); *errnop = ERANGE; return NSS_STATUS_TRYAGAIN; }
+  if( rc == 0  ){ REPORT("User id %u found in the shared cache", uid); *errnop = 0; return NSS_STATUS_SUCCESS; }
+
+  rc = index_getpwuid_r(uid, result, buffer, buflen);
+  if( rc == -1 ){ D1("Buffer too small"); *errnop = ERANGE; return NSS_STATUS_TRYAGAIN; }
+  if( rc == 0  ){ REPORT("User id %u found in the index", uid); *errnop = 0; return NSS_STATUS_SUCCESS; }
+
+  enum nss_status status;
+  if( client_nss_status(client_getpwuid_r(uid, result, buffer, buflen), &status, errnop) ){ REPORT("User id %u answered by ega-authd", uid); return status; }
+
+  pthread_once(&core_once, _load_core);
+  if(!core_getpwuid){ return NSS_STATUS_UNAVAIL; }
+  return core_getpwuid(uid, result, buffer, buflen, errnop);
+}
+
+enum nss_status
+_nss_ega_getpwnam_r(const char *username, struct passwd *result,
+		    char *buffer, size_t buflen, int *errnop)
+{
+  int rc = shmcache_getpwnam_r(username, result, buffer, buflen);
+  if( rc == -1 ){ D1("Buffer too small"); *errnop = ERANGE; return NSS_STATUS_TRYAGAIN; }
+  if( rc == 0  ){ REPORT("User %s found in the shared cache", username); *errnop = 0; return NSS_STATUS_SUCCESS; }
+
+  rc = index_getpwnam_r(username, result, buffer, buflen);
+  if( rc == -1 ){ D1("Buffer too small"); *errnop = ERANGE; return NSS_STATUS_TRYAGAIN; }
+  if( rc == 0  ){ REPORT("User %s found in the index", username); *errnop = 0; return NSS_STATUS_SUCCESS; }
+
+  enum nss_status status;
+  if( client_nss_status(client_getpwnam_r(username, result, buffer, buflen), &status, errnop) ){ REPORT("User %s answered by ega-authd", username); return status; }
+
+  pthread_once(&core_once, _load_core);
+  if(!core_getpwnam){ return NSS_STATUS_UNAVAIL; }
+  return core_getpwnam(username, result, buffer, buflen, errnop);
+}
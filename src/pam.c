@@ -27,6 +27,8 @@
 #include "utils.h"
 #include "backend.h"
 #include "cega.h"
+#include "client.h"
+#include "shmcache.h"
 
 #define PAM_OPT_DEBUG			0x01
 #define PAM_OPT_USE_FIRST_PASS		0x02
@@ -106,6 +108,8 @@ pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv)
     return PAM_AUTH_ERR;
   }
 
+  if( !loadconfig() ){ D1("Invalid configuration"); return PAM_AUTHINFO_UNAVAIL; }
+
   D1("Asking %s for password", user);
 
   /* Get the password then */
@@ -176,6 +180,8 @@ pam_sm_open_session(pam_handle_t *pamh, int flags, int argc, const char **argv)
 
   if ( (rc = pam_get_user(pamh, &username, NULL)) != PAM_SUCCESS) { D1("EGA: Unknown user: %s", pam_strerror(pamh, rc)); return rc; }
 
+  if( !loadconfig() ){ D1("Invalid configuration"); return PAM_SESSION_ERR; }
+
   /* Construct homedir */
   char *homedir = strjoina(options->ega_dir, "/", username);
   D1("Username: %s, Homedir %s", username, homedir);
@@ -223,11 +229,22 @@ pam_sm_acct_mgmt(pam_handle_t *pamh, int flags, int argc, const char *argv[])
 
   if ( (rc = pam_get_user(pamh, &username, NULL)) != PAM_SUCCESS) { D1("EGA: Unknown user: %s", pam_strerror(pamh, rc)); return rc; }
 
+  if(shmcache_has(username)){ D1("Account valid for user '%s' [shared cache]", username); return PAM_SUCCESS; }
+
+  /* ask ega-authd */
+  switch(client_account(username)){
+  case AUTHD_FOUND:     D1("Account valid for user '%s' [ega-authd]", username); return PAM_SUCCESS;
+  case AUTHD_NOT_FOUND: REPORT("Unknown user '%s'", username); return PAM_USER_UNKNOWN;
+  case AUTHD_ERROR:     REPORT("Account of '%s' could not be checked", username); return PAM_AUTHINFO_UNAVAIL;
+  default:              break; /* daemon unavailable */
+  }
+
   /* check database */
   bool use_backend = backend_opened();
   if(!use_backend){ D1("Backend disabled: Account allowed by default"); return PAM_SUCCESS; }
 
   if(!backend_has_expired(username)){ D1("Account valid for user '%s' [cached]", username); return PAM_SUCCESS; }
+  if(backend_is_unknown_user(username)){ D1("User '%s' unknown to CentralEGA [cached]", username); return PAM_USER_UNKNOWN; }
 
   /* Defining the CentralEGA callback */
   int cega_callback(char* uname, uid_t uid, char* password_hash, char* pubkey, char* gecos){
@@ -247,8 +264,15 @@ pam_sm_acct_mgmt(pam_handle_t *pamh, int flags, int argc, const char *argv[])
     D1("Error formatting the endpoint"); return PAM_SYSTEM_ERR;
   }
 
-  rc = cega_resolve(endpoint, cega_callback);
+  /* In case another process fetched it in the meantime */
+  int cached(void){
+    if(!backend_has_expired(username)) return PAM_SUCCESS;
+    return (backend_is_unknown_user(username))?CEGA_NOT_FOUND:1;
+  }
 
+  rc = cega_resolve_coalesced(endpoint, cached, cega_callback);
+
+  if(rc == CEGA_NOT_FOUND){ backend_add_unknown_user(username); REPORT("Unknown user '%s'", username); return PAM_USER_UNKNOWN; }
   if(rc == PAM_SUCCESS){ D1("Account valid for user '%s'", username); return PAM_SUCCESS; }
 
   REPORT("Account expired '%s'", username);
@@ -282,9 +306,17 @@ _get_password_hash(const char* username, char** data)
 
   D1("Fetching the password hash of %s", username);
 
+  /* ask ega-authd */
+  switch(client_get_password_hash(username, data)){
+  case AUTHD_FOUND:       return rc;
+  case AUTHD_UNAVAILABLE: break;
+  default:                return 1;
+  }
+
   /* check database */
   bool use_backend = backend_opened();
   if(use_backend && backend_get_password_hash(username, data)) return rc;
+  if(use_backend && backend_is_unknown_user(username)){ D1("User '%s' unknown to CentralEGA [cached]", username); return CEGA_NOT_FOUND; }
 
   /* Defining the CentralEGA callback */
   int _get_pwdh(char* uname, uid_t uid, char* password_hash, char* pubkey, char* gecos){
@@ -305,5 +337,13 @@ _get_password_hash(const char* username, char** data)
   if( sprintf(endpoint, options->cega_endpoint_username, username) < 0 ){
     D1("Error formatting the endpoint"); return 2;
   }
-  return cega_resolve(endpoint, _get_pwdh);
+  /* In case another process fetched it in the meantime */
+  int cached(void){
+    if(backend_get_password_hash(username, data)) return 0;
+    return (backend_is_unknown_user(username))?CEGA_NOT_FOUND:1;
+  }
+
+  rc = cega_resolve_coalesced(endpoint, (use_backend)?cached:NULL, _get_pwdh);
+  if(rc == CEGA_NOT_FOUND && use_backend) backend_add_unknown_user(username);
+  return rc;
 }
@@ -0,0 +1,81 @@
+#include <stdint.h>
+
+#include "utils.h"
+#include "config.h"
+#include "pwent.h"
+
+uint32_t
+pwent_fingerprint(void)
+{
+  /* The settings do not change once loaded: compute it once */
+  static uint32_t fingerprint = 0;
+  uint32_t f = __atomic_load_n(&fingerprint, __ATOMIC_RELAXED);
+  if(!f){
+    f = ((hash_str(options->ega_dir) * 31 + hash_str(options->shell)) ^ (uint32_t)options->gid) | 1; /* never 0 */
+    __atomic_store_n(&fingerprint, f, __ATOMIC_RELAXED);
+  }
+  return f;
+}
+
+size_t
+pwent_size(const char* username, const char* gecos)
+{
+  if(!gecos) gecos = "";
+  size_t name_len = strlen(username) + 1;
+  size_t size = name_len + 2 /* x */ + strlen(gecos) + 1 +
+                strlen(options->ega_dir) + 1 + name_len +
+                strlen(options->shell) + 1;
+  if(size > UINT16_MAX){ D1("Entry too large for %s", username); return 0; }
+  return sizeof(struct pwent_s) + size;
+}
+
+void
+pwent_fill(struct pwent_s* ent, const char* username, uid_t uid, const char* gecos)
+{
+  if(!gecos) gecos = "";
+  char* p = ent->data;
+
+  ent->fingerprint = pwent_fingerprint();
+  ent->uid = uid;
+  ent->gid = options->gid;
+  ent->_pad = 0;
+
+  p = stpcpy(p, username) + 1;
+  ent->passwd = p - ent->data;
+  p = stpcpy(p, "x") + 1;
+  ent->gecos = p - ent->data;
+  p = stpcpy(p, gecos) + 1;
+  ent->dir = p - ent->data;
+  p = stpcpy(stpcpy(stpcpy(p, options->ega_dir), "/"), username) + 1;
+  ent->shell = p - ent->data;
+  p = stpcpy(p, options->shell) + 1;
+  ent->size = p - ent->data;
+}
+
+int
+pwent_copy(const void* ent, size_t len, struct passwd *result, char *buffer, size_t buflen)
+{
+  struct pwent_s hdr;
+  if(!ent || len < sizeof(hdr)) return 1;
+
+  memcpy(&hdr, ent, sizeof(hdr)); /* not necessarily aligned, when coming from the database */
+  const char* data = (const char*)ent + sizeof(hdr);
+
+  if( len != sizeof(hdr) + hdr.size || !hdr.size || data[hdr.size - 1] != '\0' ||
+      hdr.passwd >= hdr.size || hdr.gecos >= hdr.size || hdr.dir >= hdr.size || hdr.shell >= hdr.size ){
+    D1("Invalid passwd entry");
+    return 1;
+  }
+  if( hdr.fingerprint != pwent_fingerprint() ){ D2("Passwd entry built with other settings"); return 1; }
+  if( buflen < hdr.size ){ D1("Buffer too small: %u bytes needed, %zu given", hdr.size, buflen); return -1; }
+
+  memcpy(buffer, data, hdr.size);
+  result->pw_name   = buffer;
+  result->pw_passwd = buffer + hdr.passwd;
+  result->pw_uid    = hdr.uid;
+  result->pw_gid    = hdr.gid;
+  result->pw_gecos  = buffer + hdr.gecos;
+  result->pw_dir    = buffer + hdr.dir;
+  result->pw_shell  = buffer + hdr.shell;
+  return 0;
+}
@@ -0,0 +1,47 @@
+#ifndef __LEGA_PWENT_H_INCLUDED__
+#define __LEGA_PWENT_H_INCLUDED__
+
+#include <stdint.h>
+#include <pwd.h>
+
+/*
+ * Pre-serialized passwd entry
+ *
+ * The string area of a struct passwd, laid out as it is copied
+ * in the NSS buffer, with the offset of each field.
+ * Answering a lookup is then one memcpy and a few pointer fix-ups.
+ *
+ * The home directory, the shell and the group depend on the configuration:
+ * an entry records the fingerprint of those settings,
+ * and is rejected when built with other settings.
+ */
+struct pwent_s {
+  uint32_t fingerprint;
+  uint32_t uid;
+  uint32_t gid;
+  uint16_t size;    /* of data */
+  uint16_t passwd;  /* offsets in data */
+  uint16_t gecos;
+  uint16_t dir;
+  uint16_t shell;
+  uint16_t _pad;
+  char data[];      /* username\0x\0gecos\0dir\0shell\0 */
+};
+
+uint32_t pwent_fingerprint(void);
+
+/* Size of the entry for that user, or 0 when too large */
+size_t pwent_size(const char* username, const char* gecos);
+
+/* Fills <ent>, which must be pwent_size() bytes long */
+void pwent_fill(struct pwent_s* ent, const char* username, uid_t uid, const char* gecos);
+
+/*
+ * Copies the entry <ent> (of <len> bytes) into the struct passwd.
+ *
+ * Returns -1 in case the buffer is too small, 0 on success,
+ * and 1 when the entry is invalid or was built with other settings.
+ */
+int pwent_copy(const void* ent, size_t len, struct passwd *result, char *buffer, size_t buflen);
+
+#endif /* !__LEGA_PWENT_H_INCLUDED__ */
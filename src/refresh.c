@@ -0,0 +1,96 @@
+#include <sys/types.h>
+#include <pthread.h>
+
+#include "utils.h"
+#include "backend.h"
+#include "cega.h"
+#include "refresh.h"
+
+/*
+ * Stale-while-revalidate
+ *
+ * A stale entry (see cache_grace and cache_refresh_ahead) is still served,
+ * and its username is queued here. Only the long-running processes drain
+ * the queue, from their own loop: ega-authd and ega_cache_warm -i.
+ * They purge the cache too (see backend_purge).
+ *
+ * The NSS module, the PAM module and ega_ssh_keys run inside other processes
+ * (sshd, cron, su...), which must not get children or threads behind their back:
+ * there, nothing is queued. A stale entry is served until the end of the
+ * grace window, and then fetched again, on the next lookup.
+ * When ega-authd runs, it does the lookups for them, so their stale entries
+ * are refreshed by it.
+ */
+
+#define REFRESH_QUEUE 1024 /* usernames. Further stale entries are refreshed later */
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static char* queue[REFRESH_QUEUE];
+static size_t queued = 0;
+static bool enabled = false;
+
+void
+refresh_enable(void)
+{
+  __atomic_store_n(&enabled, true, __ATOMIC_RELEASE);
+}
+
+void
+refresh_user(const char* username)
+{
+  size_t i;
+  if(!__atomic_load_n(&enabled, __ATOMIC_ACQUIRE)){ D2("No background refresh in this process: %s", username); return; }
+
+  pthread_mutex_lock(&queue_lock);
+  for(i = 0; i < queued; i++) if(!strcmp(queue[i], username)) break; /* already there */
+  if(i == queued){
+    if(queued == REFRESH_QUEUE) D1("Refresh queue full: %s refreshed later", username);
+    else if(!(queue[queued] = strdup(username))) D1("Memory allocation error");
+    else { D2("Queued %s for a refresh", username); queued++; }
+  }
+  pthread_mutex_unlock(&queue_lock);
+}
+
+void
+refresh_run(void)
+{
+  char* usernames[REFRESH_QUEUE];
+  size_t n, i, k;
+
+  if(!backend_opened()) return;
+
+  pthread_mutex_lock(&queue_lock);
+  n = queued;
+  memcpy(usernames, queue, n * sizeof(char*));
+  queued = 0;
+  pthread_mutex_unlock(&queue_lock);
+
+  /* Another process refreshed some in the meantime */
+  for(i = 0, k = 0; i < n; i++){
+    if(backend_is_fresh(usernames[i])) free(usernames[i]);
+    else usernames[k++] = usernames[i];
+  }
+  n = k;
+
+  int found(size_t i, char* username, uid_t uid, char* password_hash, char* pubkey, char* gecos){
+    return backend_add_user(username, uid, password_hash, pubkey, gecos);
+  }
+
+  void failed(size_t i, int rc){
+    if(rc != CEGA_NOT_FOUND){ D1("Could not refresh %s: served until the grace window ends", usernames[i]); return; }
+    /* Gone from CentralEGA: stop serving the stale entry */
+    REPORT("User %s no longer known to CentralEGA", usernames[i]);
+    backend_remove_user(usernames[i]);
+    backend_add_unknown_user(usernames[i]);
+  }
+
+  if(n){
+    D1("Refreshing %zu users", n);
+    if(cega_resolve_batch((const char**)usernames, NULL, n, options->refresh_concurrency, found, failed) < 0){
+      D1("Could not refresh %zu users", n);
+    }
+  }
+  for(i = 0; i < n; i++) free(usernames[i]);
+
+  if(backend_purge_due()) backend_purge();
+}
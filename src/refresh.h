@@ -0,0 +1,22 @@
+#ifndef __LEGA_REFRESH_H_INCLUDED__
+#define __LEGA_REFRESH_H_INCLUDED__
+
+/*
+ * Queue, for a refresh, a cache entry that has expired but is still served
+ * within the grace window (see cache_grace), or that is about to expire
+ * (see cache_refresh_ahead).
+ *
+ * Returns immediately. Does nothing unless refresh_enable was called.
+ */
+void refresh_user(const char* username);
+
+/*
+ * For the long-running processes only (ega-authd, ega_cache_warm -i):
+ * refresh_enable lets refresh_user queue the entries, and refresh_run,
+ * called from their loop, refreshes the ones queued (refresh_concurrency
+ * at a time) and purges the cache when due (see backend_purge).
+ */
+void refresh_enable(void);
+void refresh_run(void);
+
+#endif /* !__LEGA_REFRESH_H_INCLUDED__ */
@@ -0,0 +1,429 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "utils.h"
+#include "config.h"
+#include "pwent.h"
+#include "shmcache.h"
+
+/*
+ * Segment layout
+ *
+ *   struct shm_header_s
+ *   uint32_t by_uid[nslots]    slot number + 1 of the last user added with that uid hash, or 0
+ *   slots                      SHM_SLOT_SIZE bytes each: struct shm_slot_s and its data
+ *
+ * A user lives in one of the SHM_PROBE slots starting at hash_str(username).
+ * The uid table is only a hint: the slot it points to is checked.
+ *
+ * Each slot is a seqlock. The writer makes <seq> odd, updates the slot,
+ * and makes <seq> even again. Readers copy the slot, and retry if <seq> moved.
+ * The content is checksummed, so a torn or corrupted slot is only a miss.
+ * If a writer dies while <seq> is odd, the slot is a miss for the readers,
+ * and the next writer takes it over after SHM_LOCK_TIMEOUT seconds.
+ */
+
+#define SHM_MAGIC 0x53474745 /* EGGS */
+#define SHM_VERSION 1
+#define SHM_SLOT_SIZE 2048
+#define SHM_PROBE 16
+#define SHM_LOCK_TIMEOUT 2 /* seconds */
+
+struct shm_header_s {
+  uint32_t magic;     /* written last, when the segment is ready */
+  uint32_t version;
+  uint32_t nslots;    /* power of 2 */
+  uint32_t slot_size;
+};
+
+struct shm_slot_s {
+  uint32_t seq;       /* odd while being written */
+  uint32_t hash;      /* of the username, 0 when empty */
+  uint32_t uid;
+  uint32_t expires;
+  uint32_t locked;    /* when the writer took it */
+  uint32_t checksum;  /* of all the above but seq, and of data */
+  uint16_t entlen;    /* the struct pwent_s, at the start of data */
+  uint16_t keylen;    /* the public key, \0 included, right after it */
+  uint32_t _pad;
+  char data[];
+};
+
+#define SHM_DATA_MAX (SHM_SLOT_SIZE - sizeof(struct shm_slot_s))
+
+/* Never unmapped, since readers do not lock: replaced when the segment is */
+struct shm_map_s {
+  char* base;
+  uint32_t nslots;
+  bool writable;
+  bool checkable;     /* whether we can tell it has been replaced */
+  dev_t dev;
+  ino_t ino;
+};
+
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct shm_map_s* current = NULL;
+static time_t map_checked = 0;
+
+static inline uint32_t
+_hash(const char* username)
+{
+  uint32_t h = hash_str(username);
+  return (h)?h:1; /* 0 means empty */
+}
+
+static inline uint32_t
+_hash_uid(uid_t uid)
+{
+  return (uint32_t)uid * 2654435761u; /* Knuth */
+}
+
+static inline uint32_t*
+_by_uid(const struct shm_map_s* m)
+{
+  return (uint32_t*)(m->base + sizeof(struct shm_header_s));
+}
+
+static inline struct shm_slot_s*
+_slot(const struct shm_map_s* m, uint32_t i)
+{
+  return (struct shm_slot_s*)(m->base + sizeof(struct shm_header_s) +
+			      m->nslots * sizeof(uint32_t) + (size_t)i * SHM_SLOT_SIZE);
+}
+
+static uint32_t
+_checksum(const struct shm_slot_s* slot)
+{
+  uint32_t h = 2166136261u;
+  const unsigned char* p = (const unsigned char*)slot->data;
+  size_t n = slot->entlen + slot->keylen;
+  while(n--){ h ^= *p++; h *= 16777619u; }
+  return h ^ slot->hash ^ _hash_uid(slot->uid) ^ slot->expires ^ ((uint32_t)slot->entlen << 16 | slot->keylen);
+}
+
+
+/*
+ * Mapping
+ *
+ * The segment is created by the first root process that needs it.
+ * We check at most once per second whether it has been replaced.
+ *
+ * Only a segment owned by root, and writable by root only, is used:
+ * anybody can create one under that name, and fill it with users.
+ * Root removes such a segment, and creates its own, exclusively.
+ */
+
+static inline bool
+_trusted(const struct stat* st)
+{
+  return S_ISREG(st->st_mode) && st->st_uid == 0 && !(st->st_mode & 022);
+}
+
+/* Opens the segment, creating it (empty) when root. Returns the descriptor, or -1 */
+static int
+_open(bool writer, struct stat* st)
+{
+  int fd = shm_open(options->shm_name, (writer)?O_RDWR:O_RDONLY, 0);
+  if(fd >= 0){
+    if(fstat(fd, st)){ D1("Could not stat %s: %s", options->shm_name, strerror(errno)); close(fd); return -1; }
+    if(_trusted(st)) return fd;
+    close(fd);
+    if(!writer){ D1("Shared cache %s not owned by root, or writable by others: ignored", options->shm_name); return -1; }
+    D1("Removing the shared cache %s: not owned by root, or writable by others", options->shm_name);
+    if(shm_unlink(options->shm_name)){ D1("Could not remove %s: %s", options->shm_name, strerror(errno)); return -1; }
+  } else if(!writer || errno != ENOENT){
+    D2("No shared cache %s: %s", options->shm_name, strerror(errno));
+    return -1;
+  }
+
+  /* Ours, or nothing: another one created in the meantime is left alone */
+  fd = shm_open(options->shm_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if(fd < 0){ D1("Could not create %s: %s", options->shm_name, strerror(errno)); return -1; }
+  if(fstat(fd, st)){ D1("Could not stat %s: %s", options->shm_name, strerror(errno)); close(fd); return -1; }
+  return fd;
+}
+
+/* Called with the lock */
+static void
+_remap(void)
+{
+  char* path = strjoina("/dev/shm", options->shm_name); /* where glibc puts them */
+  struct stat st;
+  struct shm_map_s* m = current;
+
+  if(m){
+    if(!m->checkable) return;
+    if(!stat(path, &st) && st.st_dev == m->dev && st.st_ino == m->ino) return; /* unchanged */
+    D2("Shared cache %s replaced", options->shm_name);
+    __atomic_store_n(&current, NULL, __ATOMIC_RELEASE); /* but left mapped */
+  }
+
+  bool writer = (getuid() == 0);
+  void* base = MAP_FAILED;
+  int fd = _open(writer, &st);
+  if(fd < 0) return;
+
+  if(st.st_size == 0 && writer){
+    uint32_t nslots = 16;
+    while(nslots < options->shm_slots) nslots <<= 1;
+    off_t size = sizeof(struct shm_header_s) + (off_t)nslots * (sizeof(uint32_t) + SHM_SLOT_SIZE);
+    D1("Creating the shared cache %s [%u slots]", options->shm_name, nslots);
+    if(fchmod(fd, 0644) || ftruncate(fd, size)){ D1("Could not create %s: %s", options->shm_name, strerror(errno)); goto BAILOUT; }
+    st.st_size = size;
+  }
+  if((size_t)st.st_size < sizeof(struct shm_header_s)){ D2("Shared cache %s not ready", options->shm_name); goto BAILOUT; }
+
+  base = mmap(NULL, st.st_size, PROT_READ | ((writer)?PROT_WRITE:0), MAP_SHARED, fd, 0);
+  if(base == MAP_FAILED){ D1("Could not map %s: %s", options->shm_name, strerror(errno)); goto BAILOUT; }
+
+  /* The number of slots follows from the size. The header only confirms it */
+  struct shm_header_s* hdr = (struct shm_header_s*)base;
+  uint32_t nslots = (st.st_size - sizeof(*hdr)) / (sizeof(uint32_t) + SHM_SLOT_SIZE);
+
+  if(writer && __atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC){
+    hdr->version = SHM_VERSION;
+    hdr->nslots = nslots;
+    hdr->slot_size = SHM_SLOT_SIZE;
+    __atomic_store_n(&hdr->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+  }
+
+  if( __atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC || hdr->version != SHM_VERSION ||
+      hdr->slot_size != SHM_SLOT_SIZE || hdr->nslots != nslots || !nslots || (nslots & (nslots - 1)) ){
+    D1("Invalid shared cache: %s", options->shm_name);
+    goto BAILOUT;
+  }
+
+  m = malloc(sizeof(struct shm_map_s));
+  if(!m){ D1("Memory allocation error"); goto BAILOUT; }
+  m->base = (char*)base;
+  m->nslots = nslots;
+  m->writable = writer;
+  m->dev = st.st_dev;
+  m->ino = st.st_ino;
+  struct stat st2;
+  m->checkable = !stat(path, &st2) && st2.st_dev == st.st_dev && st2.st_ino == st.st_ino;
+
+  D2("Mapped shared cache %s [%u slots%s]", options->shm_name, nslots, (writer)?", writable":"");
+  __atomic_store_n(&current, m, __ATOMIC_RELEASE);
+  base = MAP_FAILED; /* in use */
+
+BAILOUT:
+  if(base != MAP_FAILED) munmap(base, st.st_size);
+  close(fd);
+}
+
+static const struct shm_map_s*
+_acquire(void)
+{
+  if(!loadconfig() || !options->shm_name) return NULL;
+
+  time_t now = time(NULL);
+  if(__atomic_load_n(&map_checked, __ATOMIC_ACQUIRE) != now){
+    pthread_mutex_lock(&map_lock);
+    if(map_checked != now){ _remap(); __atomic_store_n(&map_checked, now, __ATOMIC_RELEASE); }
+    pthread_mutex_unlock(&map_lock);
+  }
+  return __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * Reading
+ */
+
+/*
+ * Copies slot <i> into <copy> (SHM_SLOT_SIZE bytes), if it holds the username hash <hash>
+ * (or the user id <uid> when <hash> is 0), is consistent and has not expired.
+ */
+static bool
+_read(const struct shm_map_s* m, uint32_t i, uint32_t hash, uid_t uid, struct shm_slot_s* copy)
+{
+  const struct shm_slot_s* slot = _slot(m, i);
+  int tries;
+  for(tries = 0; tries < 3; tries++){
+    uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if(seq & 1) return false; /* being written, or its writer died */
+
+    memcpy(copy, slot, sizeof(*copy));
+    bool match = (hash)?(copy->hash == hash):(copy->hash && copy->uid == uid);
+    size_t len = copy->entlen + copy->keylen;
+    if(match && len <= SHM_DATA_MAX) memcpy(copy->data, slot->data, len);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if(__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) continue; /* updated in the meantime */
+
+    if(!match) return false;
+    if( len > SHM_DATA_MAX || copy->entlen <= sizeof(struct pwent_s) || copy->checksum != _checksum(copy) ||
+	copy->data[copy->entlen - 1] != '\0' || (copy->keylen && copy->data[len - 1] != '\0') ){
+      D1("Corrupted slot %u in the shared cache", i);
+      return false;
+    }
+    return copy->expires > (uint32_t)time(NULL);
+  }
+  return false;
+}
+
+static bool
+_find(const struct shm_map_s* m, const char* username, struct shm_slot_s* copy)
+{
+  uint32_t h = _hash(username);
+  uint32_t mask = m->nslots - 1;
+  uint32_t p;
+  for(p = 0; p < SHM_PROBE; p++){
+    if( _read(m, (h + p) & mask, h, 0, copy) &&
+	!strcmp(((const struct pwent_s*)copy->data)->data, username) ) return true;
+  }
+  return false;
+}
+
+int
+shmcache_getpwnam_r(const char* username, struct passwd *result, char *buffer, size_t buflen)
+{
+  const struct shm_map_s* m = _acquire();
+  if(!m) return 1;
+
+  char copy[SHM_SLOT_SIZE] __attribute__((aligned(8)));
+  struct shm_slot_s* slot = (struct shm_slot_s*)copy;
+  if(!_find(m, username, slot)) return 1;
+  return pwent_copy(slot->data, slot->entlen, result, buffer, buflen);
+}
+
+int
+shmcache_getpwuid_r(uid_t uid, struct passwd *result, char *buffer, size_t buflen)
+{
+  const struct shm_map_s* m = _acquire();
+  if(!m) return 1;
+
+  uint32_t i = __atomic_load_n(&_by_uid(m)[_hash_uid(uid) & (m->nslots - 1)], __ATOMIC_RELAXED);
+  if(!i || i > m->nslots) return 1;
+
+  char copy[SHM_SLOT_SIZE] __attribute__((aligned(8)));
+  struct shm_slot_s* slot = (struct shm_slot_s*)copy;
+  if(!_read(m, i - 1, 0, uid, slot)) return 1;
+  return pwent_copy(slot->data, slot->entlen, result, buffer, buflen);
+}
+
+bool
+shmcache_has(const char* username)
+{
+  const struct shm_map_s* m = _acquire();
+  if(!m) return false;
+
+  char copy[SHM_SLOT_SIZE] __attribute__((aligned(8)));
+  return _find(m, username, (struct shm_slot_s*)copy);
+}
+
+bool
+shmcache_print_pubkey(const char* username)
+{
+  const struct shm_map_s* m = _acquire();
+  if(!m) return false;
+
+  char copy[SHM_SLOT_SIZE] __attribute__((aligned(8)));
+  struct shm_slot_s* slot = (struct shm_slot_s*)copy;
+  if(!_find(m, username, slot) || !slot->keylen) return false;
+  printf("%s", slot->data + slot->entlen);
+  return true;
+}
+
+
+/*
+ * Writing (root only)
+ */
+
+static bool
+_lock(struct shm_slot_s* slot, time_t now)
+{
+  uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+  uint32_t next = seq + 1;
+  if(seq & 1){
+    if(now - (time_t)__atomic_load_n(&slot->locked, __ATOMIC_RELAXED) < SHM_LOCK_TIMEOUT) return false; /* being written */
+    D1("Taking over a slot of the shared cache: its writer died");
+    next = seq + 2; /* still odd */
+  }
+  if(!__atomic_compare_exchange_n(&slot->seq, &seq, next, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return false;
+  __atomic_store_n(&slot->locked, (uint32_t)now, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE); /* seq is odd before any change */
+  return true;
+}
+
+static void
+_unlock(struct shm_slot_s* slot)
+{
+  slot->checksum = _checksum(slot);
+  __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * The slot for that user: the one it is already in, or an empty or expired one,
+ * or else the one expiring first. Returned locked.
+ */
+static struct shm_slot_s*
+_claim(const struct shm_map_s* m, uint32_t h, uint32_t* index, bool existing_only)
+{
+  uint32_t mask = m->nslots - 1;
+  uint32_t now = (uint32_t)time(NULL);
+  struct shm_slot_s* best = NULL;
+  uint32_t best_rank = UINT32_MAX;
+  uint32_t p;
+  for(p = 0; p < SHM_PROBE; p++){
+    uint32_t i = (h + p) & mask;
+    struct shm_slot_s* slot = _slot(m, i);
+    uint32_t sh = __atomic_load_n(&slot->hash, __ATOMIC_RELAXED);
+    if(sh == h){ best = slot; *index = i; break; } /* already there */
+    if(existing_only) continue;
+    uint32_t rank = (!sh || slot->expires <= now)?0:slot->expires; /* the lower, the better */
+    if(!best || rank < best_rank){ best = slot; best_rank = rank; *index = i; }
+  }
+  if(!best || (existing_only && best->hash != h)) return NULL;
+  if(!_lock(best, now)){ D2("Slot %u of the shared cache busy", *index); return NULL; }
+  return best;
+}
+
+void
+shmcache_add(const char* username, uid_t uid, const char* gecos, const char* pubkey, time_t expires)
+{
+  const struct shm_map_s* m = _acquire();
+  if(!m || !m->writable) return;
+
+  size_t entlen = pwent_size(username, gecos);
+  size_t keylen = (pubkey)?strlen(pubkey) + 1:0;
+  if(!entlen || entlen + keylen > SHM_DATA_MAX){ D2("%s too large for the shared cache", username); shmcache_remove(username); return; }
+
+  uint32_t i, h = _hash(username);
+  struct shm_slot_s* slot = _claim(m, h, &i, false);
+  if(!slot) return;
+
+  slot->hash = h;
+  slot->uid = uid;
+  slot->expires = (uint32_t)expires;
+  slot->entlen = entlen;
+  slot->keylen = keylen;
+  pwent_fill((struct pwent_s*)slot->data, username, uid, gecos);
+  if(keylen) memcpy(slot->data + entlen, pubkey, keylen);
+  _unlock(slot);
+
+  __atomic_store_n(&_by_uid(m)[_hash_uid(uid) & (m->nslots - 1)], i + 1, __ATOMIC_RELAXED);
+  D2("%s added to the shared cache [slot %u]", username, i);
+}
+
+void
+shmcache_remove(const char* username)
+{
+  const struct shm_map_s* m = _acquire();
+  if(!m || !m->writable) return;
+
+  uint32_t i;
+  struct shm_slot_s* slot = _claim(m, _hash(username), &i, true);
+  if(!slot) return;
+  slot->hash = 0;
+  slot->entlen = slot->keylen = 0;
+  _unlock(slot);
+  D2("%s removed from the shared cache [slot %u]", username, i);
+}
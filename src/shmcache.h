@@ -0,0 +1,34 @@
+#ifndef __LEGA_SHMCACHE_H_INCLUDED__
+#define __LEGA_SHMCACHE_H_INCLUDED__
+
+#include <stdbool.h>
+#include <time.h>
+#include <pwd.h>
+
+/*
+ * Cache shared by all processes, in a POSIX shared memory segment.
+ *
+ * Filled by root, through backend_add_user, and read without locks.
+ * It holds the passwd entries and the public keys, not the password hashes:
+ * the segment is readable by every process.
+ * Disabled when shm_name is not set.
+ */
+
+/*
+ * Both return -1 in case the buffer is too small,
+ * 0 when found, and 1 when the user is not in the segment (or expired).
+ */
+int shmcache_getpwnam_r(const char* username, struct passwd *result, char *buffer, size_t buflen);
+int shmcache_getpwuid_r(uid_t uid, struct passwd *result, char *buffer, size_t buflen);
+
+/* Whether the user is in the segment and not expired */
+bool shmcache_has(const char* username);
+
+/* Prints the public key, if the user is in the segment and not expired */
+bool shmcache_print_pubkey(const char* username);
+
+/* Only root can update the segment. Those do nothing otherwise */
+void shmcache_add(const char* username, uid_t uid, const char* gecos, const char* pubkey, time_t expires);
+void shmcache_remove(const char* username);
+
+#endif /* !__LEGA_SHMCACHE_H_INCLUDED__ */
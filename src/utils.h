@@ -112,4 +112,13 @@ copy2buffer(const char* data, char** dest, char **bufptr, size_t *buflen)
   return slen;
 }
 
+/* FNV-1a string hash */
+static inline unsigned int
+hash_str(const char* s)
+{
+  unsigned int h = 2166136261u;
+  while(*s){ h ^= (unsigned char)*s++; h *= 16777619u; }
+  return h;
+}
+
 #endif /* !__LEGA_UTILS_H_INCLUDED__ */
@@ -0,0 +1,290 @@
+#include <stdio.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "utils.h"
+#include "backend.h"
+#include "cega.h"
+#include "refresh.h"
+
+/*
+ * Fills the cache, before the users log in (eg after a reboot)
+ *
+ * Reads the usernames from a file, or stdin, one per line (with -u, the uids,
+ * eg the owners of the inbox directories, before listing them).
+ * They are fetched from CentralEGA, <parallel> requests at a time
+ * (through the batch endpoints, when set), and inserted <batch> at a time,
+ * each batch in one transaction.
+ * The users already cached, and not expired, are skipped,
+ * as well as the ones CentralEGA recently did not know.
+ *
+ * With -n, the users are only fetched, not cached, and none are skipped:
+ * it measures how fast CentralEGA answers.
+ *
+ * With -s, it instead fetches the users changed at CentralEGA since
+ * the last sync (see cega_endpoint_changes), and with -i, it keeps
+ * doing so, every <interval> seconds, purging the cache when due.
+ */
+
+#define WARM_PARALLEL 8
+#define WARM_BATCH 500
+#define SYNC_OVERLAP 60 /* seconds: for the clock skew, and the changes in flight at CentralEGA */
+
+struct warm_user_s {
+  char* username;
+  uid_t uid;
+  char* pwdh;
+  char* pubkey;
+  char* gecos;
+};
+
+static double
+_now(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void
+_free_user(struct warm_user_s* u)
+{
+  free(u->username);
+  free(u->pwdh);
+  free(u->pubkey);
+  free(u->gecos);
+  memset(u, 0, sizeof(*u));
+}
+
+static char*
+_trim(char* s)
+{
+  char* end;
+  while(isspace(*s)) s++;
+  end = s + strlen(s);
+  while(end > s && isspace(*(end - 1))) end--;
+  *end = '\0';
+  return s;
+}
+
+/*
+ * Fetches the users changed since the watermark, and upserts them
+ * in one transaction, along with the new watermark.
+ * The watermark is not moved when a user could not be cached.
+ * Returns 0 on success.
+ */
+static int
+_sync(void)
+{
+  unsigned int cached = 0, invalid = 0, failed = 0;
+  bool started = false;
+  time_t since = backend_synced();
+  time_t start = time(NULL);
+  int rc = 1;
+
+  char stamp[21]; /* 64 bits */
+  snprintf(stamp, sizeof(stamp), "%lld", (long long)since);
+  _cleanup_str_ char* endpoint = malloc(options->cega_endpoint_changes_len + strlen(stamp));
+  if(!endpoint){ D1("Memory allocation error"); return 1; }
+  sprintf(endpoint, options->cega_endpoint_changes, stamp);
+
+  int add(char* username, uid_t uid, char* pwdh, char* pubkey, char* gecos){
+    if(!started){
+      if(backend_batch_begin()){ failed++; return 1; }
+      started = true;
+    }
+    if(backend_add_user(username, uid, pwdh, pubkey, gecos)){
+      fprintf(stderr, "%s: could not be cached\n", username);
+      failed++;
+      return 1;
+    }
+    cached++;
+    return 0;
+  }
+
+  double t = _now();
+  int n = cega_resolve_all(endpoint, add);
+  if(n < 0){ fprintf(stderr, "Could not get the changes from CentralEGA\n"); goto BAILOUT; }
+  invalid = n - failed;
+
+  if(!started){
+    if(backend_batch_begin()){ fprintf(stderr, "Could not open the transaction\n"); goto BAILOUT; }
+    started = true;
+  }
+  if(!failed && backend_set_synced(start - SYNC_OVERLAP)) failed++;
+  started = false;
+  if(backend_batch_end()){ fprintf(stderr, "Could not commit %u users\n", cached); failed += cached; cached = 0; goto BAILOUT; }
+
+  if(cached && backend_update_index()) fprintf(stderr, "Could not rebuild the lookup index\n");
+
+  printf("%u users changed since %lld, in %.2fs: %u cached, %u invalid, %u failed\n",
+	 cached + invalid + failed, (long long)since, _now() - t, cached, invalid, failed);
+  rc = (failed)?1:0;
+
+BAILOUT:
+  if(started) backend_batch_abort(); /* all or nothing, with the watermark */
+  return rc;
+}
+
+int
+main(int argc, char * const argv[])
+{
+  int rc = 1, opt;
+  unsigned int parallel = WARM_PARALLEL, batch = WARM_BATCH, interval = 0;
+  bool sync = false, by_uid = false, dry = false;
+  unsigned int cached = 0, skipped = 0, unknown = 0, failed = 0, invalid = 0;
+  FILE* fp = stdin;
+  char** usernames = NULL;
+  uid_t* uids = NULL;
+  size_t n = 0, max = 0, i;
+  struct warm_user_s* pending = NULL;
+  size_t npending = 0;
+  _cleanup_str_ char* line = NULL;
+  size_t len = 0;
+
+  while((opt = getopt(argc, argv, "j:b:unsi:")) != -1){
+    switch(opt){
+    case 'j': parallel = (unsigned int)atoi(optarg); break;
+    case 'b': batch = (unsigned int)atoi(optarg); break;
+    case 'u': by_uid = true; break;
+    case 'n': dry = true; break;
+    case 's': sync = true; break;
+    case 'i': sync = true; interval = (unsigned int)atoi(optarg); if(!interval) goto USAGE; break;
+    default: goto USAGE;
+    }
+  }
+  if(argc > optind + 1 || !parallel || !batch || (sync && (argc > optind || by_uid || dry))) goto USAGE;
+  if(optind < argc && strcmp(argv[optind], "-") && !(fp = fopen(argv[optind], "r"))){
+    fprintf(stderr, "Could not open %s: %s\n", argv[optind], strerror(errno));
+    return 1;
+  }
+
+  if(dry){
+    if(!loadconfig()){ fprintf(stderr, "Invalid configuration\n"); goto BAILOUT; }
+  } else {
+    if(geteuid() != 0){ fprintf(stderr, "Only root can update the cache\n"); goto BAILOUT; }
+    if(!backend_opened()){ fprintf(stderr, "Could not open the cache\n"); goto BAILOUT; }
+  }
+
+  if(sync){
+    if(!options->cega_endpoint_changes){ fprintf(stderr, "cega_endpoint_changes is not set\n"); goto BAILOUT; }
+    if(interval) refresh_enable();
+    for(;;){
+      rc = _sync();
+      if(!interval) break;
+      refresh_run(); /* and the purge */
+      fflush(stdout);
+      sleep(interval);
+    }
+    goto BAILOUT;
+  }
+
+  /* The usernames, or the uids */
+  while(getline(&line, &len, fp) > 0){
+    char* username = _trim(line);
+    char* end = NULL;
+    uid_t uid = 0;
+    if(!*username || *username == '#') continue;
+    if(by_uid){
+      uid = (uid_t)strtoul(username, &end, 10);
+      if(*end || uid < options->uid_shift){ fprintf(stderr, "%s: invalid uid\n", username); invalid++; continue; }
+      if(!dry && (backend_is_fresh_uid(uid) || backend_is_unknown_uid(uid))){ skipped++; continue; }
+    } else if(!dry && (backend_is_fresh(username) || backend_is_unknown_user(username))){ skipped++; continue; }
+
+    if(n == max){
+      max = (max)?(max << 1):1024;
+      if(by_uid){
+	uid_t* u = realloc(uids, max * sizeof(uid_t));
+	if(!u){ D1("Memory allocation error"); goto BAILOUT; }
+	uids = u;
+      } else {
+	char** u = realloc(usernames, max * sizeof(char*));
+	if(!u){ D1("Memory allocation error"); goto BAILOUT; }
+	usernames = u;
+      }
+    }
+    if(by_uid){ uids[n++] = uid; continue; }
+    usernames[n] = strdup(username);
+    if(!usernames[n]){ D1("Memory allocation error"); goto BAILOUT; }
+    n++;
+  }
+
+  pending = calloc(batch, sizeof(struct warm_user_s));
+  if(!pending){ D1("Memory allocation error"); goto BAILOUT; }
+
+  /* Inserts the pending users, in one transaction */
+  void flush(void){
+    size_t k;
+    unsigned int added = 0;
+    if(!npending) return;
+    if(backend_batch_begin()){
+      failed += npending;
+    } else {
+      for(k = 0; k < npending; k++){
+	if(backend_add_user(pending[k].username, pending[k].uid, pending[k].pwdh, pending[k].pubkey, pending[k].gecos)){
+	  fprintf(stderr, "%s: could not be cached\n", pending[k].username);
+	  failed++;
+	} else added++;
+      }
+      if(backend_batch_end()){ fprintf(stderr, "Could not commit %u users\n", added); failed += added; added = 0; }
+    }
+    cached += added;
+    for(k = 0; k < npending; k++) _free_user(&pending[k]);
+    npending = 0;
+  }
+
+  int found_cb(size_t k, char* username, uid_t uid, char* pwdh, char* pubkey, char* gecos){
+    if(dry){ cached++; return 0; }
+    struct warm_user_s* u = &pending[npending++];
+    u->username = strdup(username);
+    u->uid = uid;
+    u->pwdh = (pwdh)?strdup(pwdh):NULL;
+    u->pubkey = (pubkey)?strdup(pubkey):NULL;
+    u->gecos = (gecos)?strdup(gecos):NULL;
+    if(npending == batch) flush();
+    return 0;
+  }
+
+  void failed_cb(size_t k, int err){
+    if(by_uid) fprintf(stderr, "uid %u: ", uids[k]);
+    else fprintf(stderr, "%s: ", usernames[k]);
+    if(err == CEGA_NOT_FOUND){
+      fprintf(stderr, "unknown to CentralEGA\n");
+      if(!dry && by_uid) backend_add_unknown_uid(uids[k]);
+      else if(!dry) backend_add_unknown_user(usernames[k]);
+      unknown++;
+    } else {
+      fprintf(stderr, "failed\n");
+      failed++;
+    }
+  }
+
+  double start = _now();
+  if(cega_resolve_batch((const char**)usernames, uids, n, parallel, found_cb, failed_cb) < 0){
+    fprintf(stderr, "Could not contact CentralEGA\n");
+    failed += n - (cached + npending + unknown + failed); /* the ones not done */
+  }
+  flush();
+  if(!dry && cached && backend_update_index()) fprintf(stderr, "Could not rebuild the lookup index\n");
+  failed += invalid;
+  double elapsed = _now() - start;
+
+  printf("%zu users in %.2fs (%.0f users/s): %u %s, %u unknown, %u failed, %u skipped (already cached)\n",
+	 n, elapsed, (elapsed > 0)?n / elapsed:0, cached, (dry)?"found":"cached", unknown, failed, skipped);
+  rc = (failed)?1:0;
+
+BAILOUT:
+  if(fp != stdin) fclose(fp);
+  if(usernames) for(i = 0; i < n; i++) free(usernames[i]);
+  free(usernames);
+  free(uids);
+  free(pending);
+  return rc;
+
+USAGE:
+  fprintf(stderr, "Usage: %s [-j parallel] [-b batch] [-u] [-n] [file]\n"
+	          "       %s -s | -i interval\n", argv[0], argv[0]);
+  return 1;
+}